@@ -1,19 +1,35 @@
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define BS 4096u
 #define INODE_SIZE 128u
 #define ROOT_INO 1u
 #define DIRECT_MAX 12
 
+#define SB_FLAG_MERKLE      0x1u    // superblock_t.flags: hash tree present
+#define MERKLE_GROUP_BLOCKS 64u     // blocks hashed into one leaf
+#define MERKLE_LEAVES       16u     // 4096 KiB max image / 64 blocks per leaf
+#define MERKLE_NODES        (2*MERKLE_LEAVES-1)
+#define MERKLE_OFFSET       2048u   // byte offset of the node array in block 0
+
 #pragma pack(push,1)
 typedef struct {
     uint32_t magic;
@@ -115,190 +131,1374 @@ static void dirent_checksum_finalize(dirent64_t* de) {
     de->checksum = x;
 }
 
+// ================= Metrics =================
+// Counters and latency histograms for --metrics, written to a file in the
+// Prometheus text format (e.g. for node_exporter's textfile collector).
+// Everything is a relaxed atomic, so reader threads record without taking
+// a lock. Histogram bucket i counts samples of more than 2^(i-1) and at
+// most 2^i microseconds (bucket 0: up to 1 us), matching the inclusive `le`
+// bounds of the format; the last bucket only shows up as +Inf.
+#define HIST_BUCKETS 24          // largest finite bound 2^22 us, about 4 s
+
+typedef struct {
+    _Atomic uint64_t count, sum_us;
+    _Atomic uint64_t bucket[HIST_BUCKETS];
+} hist_t;
+
+static struct {
+    _Atomic uint64_t files_added, files_linked, bytes_added;
+    _Atomic uint64_t commits, blocks_written;
+    _Atomic uint64_t host_read_bytes, read_waits;
+    _Atomic uint64_t crc_bytes, bitmap_scan_bits;
+    hist_t read_us, commit_us;
+} metrics;
+
+static inline void metric_add(_Atomic uint64_t* m, uint64_t v){ atomic_fetch_add_explicit(m, v, memory_order_relaxed); }
+static inline uint64_t metric_get(_Atomic uint64_t* m){ return atomic_load_explicit(m, memory_order_relaxed); }
+
+static uint64_t now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void hist_record(hist_t* h, uint64_t us){
+    unsigned b = 0;
+    uint64_t v = us ? us - 1 : 0;
+    while (b < HIST_BUCKETS-1 && v >> b) b++;
+    metric_add(&h->bucket[b], 1);
+    metric_add(&h->sum_us, us);
+    metric_add(&h->count, 1);
+}
+
+// Label value with \, " and newline escaped as the format requires
+static void prom_label(FILE* f, const char* s){
+    for (; *s; s++){
+        if (*s == '\\' || *s == '"') fputc('\\', f);
+        if (*s == '\n'){ fputs("\\n", f); continue; }
+        fputc(*s, f);
+    }
+}
+
+static void prom_counter(FILE* f, const char* name, const char* help, const char* image, uint64_t v){
+    fprintf(f, "# HELP minivsfs_adder_%s %s\n# TYPE minivsfs_adder_%s counter\nminivsfs_adder_%s{image=\"", name, help, name, name);
+    prom_label(f, image);
+    fprintf(f, "\"} %" PRIu64 "\n", v);
+}
+
+static void prom_gauge(FILE* f, const char* name, const char* help, const char* image, uint64_t v){
+    fprintf(f, "# HELP minivsfs_%s %s\n# TYPE minivsfs_%s gauge\nminivsfs_%s{image=\"", name, help, name, name);
+    prom_label(f, image);
+    fprintf(f, "\"} %" PRIu64 "\n", v);
+}
+
+static void prom_hist(FILE* f, const char* name, const char* help, const char* image, hist_t* h){
+    fprintf(f, "# HELP minivsfs_adder_%s %s\n# TYPE minivsfs_adder_%s histogram\n", name, help, name);
+    uint64_t cum = 0;
+    for (unsigned b=0;b<HIST_BUCKETS-1;b++){
+        cum += metric_get(&h->bucket[b]);
+        fprintf(f, "minivsfs_adder_%s_bucket{image=\"", name);
+        prom_label(f, image);
+        fprintf(f, "\",le=\"%.6f\"} %" PRIu64 "\n", (double)(1ull << b) / 1e6, cum);
+    }
+    fprintf(f, "minivsfs_adder_%s_bucket{image=\"", name);
+    prom_label(f, image);
+    fprintf(f, "\",le=\"+Inf\"} %" PRIu64 "\n", metric_get(&h->count));
+    fprintf(f, "minivsfs_adder_%s_sum{image=\"", name);
+    prom_label(f, image);
+    fprintf(f, "\"} %g\nminivsfs_adder_%s_count{image=\"", (double)metric_get(&h->sum_us) / 1e6, name);
+    prom_label(f, image);
+    fprintf(f, "\"} %" PRIu64 "\n", metric_get(&h->count));
+}
+
 // ================= Bitmap helpers =================
 static inline void bitmap_set(uint8_t* bm, size_t idx){ bm[idx>>3] |= (uint8_t)(1u << (idx & 7u)); }
 static inline void bitmap_clear(uint8_t* bm, size_t idx){ bm[idx>>3] &= (uint8_t)~(1u << (idx & 7u)); }
 static inline int  bitmap_test(const uint8_t* bm, size_t idx){ return (bm[idx>>3] >> (idx & 7u)) & 1u; }
-static long long bitmap_ffz(const uint8_t* bm, size_t bits){
-    for (size_t i=0;i<bits;i++){ if (!bitmap_test(bm,i)) return (long long)i; }
+static size_t bitmap_count_zero(const uint8_t* bm, size_t bits){
+    metric_add(&metrics.bitmap_scan_bits, bits);
+    size_t n=0;
+    for (size_t i=0;i<bits;i++) n += !bitmap_test(bm,i);
+    return n;
+}
+
+// ================= Batch checksums =================
+// A table-driven CRC32 is one long dependency chain per buffer: each byte
+// waits for the previous lookup. Inodes are small and independent, so these
+// run CRC_LANES of them side by side, interleaving the chains so their
+// lookups overlap. An inode's 120-byte CRC (mkfs_builder) is the running
+// value after its first 120 bytes and its 128-byte CRC (mkfs_adder) is the
+// same chain continued over the zeroed crc field, so one pass yields both.
+#define CRC_LANES 4
+
+// n <= CRC_LANES inodes; c120/c128 may be NULL
+static void inode_crc_lanes(const inode_t* const* in, size_t n, uint32_t* c120, uint32_t* c128){
+    const uint8_t* p[CRC_LANES];
+    for (size_t l=0;l<CRC_LANES;l++) p[l] = (const uint8_t*)in[l < n ? l : 0];
+    uint32_t c0 = 0xFFFFFFFFu, c1 = c0, c2 = c0, c3 = c0;
+    const size_t body = offsetof(inode_t, inode_crc);
+    for (size_t i=0;i<body;i++){
+        c0 = CRC32_TAB[(c0 ^ p[0][i]) & 0xFFu] ^ (c0>>8);
+        c1 = CRC32_TAB[(c1 ^ p[1][i]) & 0xFFu] ^ (c1>>8);
+        c2 = CRC32_TAB[(c2 ^ p[2][i]) & 0xFFu] ^ (c2>>8);
+        c3 = CRC32_TAB[(c3 ^ p[3][i]) & 0xFFu] ^ (c3>>8);
+    }
+    uint32_t c[CRC_LANES] = { c0, c1, c2, c3 };
+    for (size_t l=0;l<n;l++){
+        if (c120) c120[l] = c[l] ^ 0xFFFFFFFFu;
+        if (c128){
+            uint32_t x = c[l];
+            for (size_t i=body;i<INODE_SIZE;i++) x = CRC32_TAB[x & 0xFFu] ^ (x>>8);
+            c128[l] = x ^ 0xFFFFFFFFu;
+        }
+    }
+}
+
+// inode_crc_finalize() for up to CRC_LANES inodes at once
+static void inode_crc_finalize_lanes(inode_t* const* in, size_t n){
+    uint32_t c[CRC_LANES];
+    inode_crc_lanes((const inode_t* const*)in, n, NULL, c);
+    for (size_t l=0;l<n;l++) in[l]->inode_crc = c[l];
+}
+
+// A dirent's checksum byte is the XOR of its other 63 bytes, so the XOR of
+// all 64 is zero exactly when it is intact: eight 64-bit XORs and a fold per
+// entry instead of 63 byte steps. Returns the first used entry of the block
+// that fails, or -1.
+static long dirent_block_check(const uint8_t* blk){
+    for (size_t e=0;e<BS/64;e++){
+        const uint8_t* d = blk + e*64;
+        uint64_t w[8];
+        memcpy(w, d, sizeof(w));
+        uint32_t ino;
+        memcpy(&ino, d, sizeof(ino));
+        if (!ino) continue;
+        uint64_t x = w[0]^w[1]^w[2]^w[3]^w[4]^w[5]^w[6]^w[7];
+        x ^= x >> 32; x ^= x >> 16; x ^= x >> 8;
+        if ((uint8_t)x) return (long)e;
+    }
     return -1;
 }
 
-// ================= CLI =================
-static void usage(const char* prog){
-    fprintf(stderr, "Usage: %s --input in.img --output out.img --file <path>\n", prog);
+// ================= Free-extent index =================
+// Free runs of the data bitmap, kept in two sorted arrays: by start block
+// (to find the run holding a block, and the lowest free block) and by
+// (length, start) for best-fit lookups. Both are binary searched. Built
+// from data_bm on load and updated on every allocation, so data_bm is
+// scanned once per run instead of once per block. Sorted arrays stand in
+// for B-trees because the data region is at most 1024 blocks (512 runs).
+typedef struct { uint32_t start, len; } extent_t;
+typedef struct {
+    extent_t* by_off;
+    extent_t* by_size;
+    size_t    n;
+} extent_index_t;
+
+static int ext_size_less(extent_t a, extent_t b){
+    return a.len != b.len ? a.len < b.len : a.start < b.start;
+}
+// First run starting at or after `start`
+static size_t ext_lb_off(const extent_index_t* x, uint32_t start){
+    size_t lo=0, hi=x->n;
+    while (lo<hi){ size_t m=(lo+hi)/2; if (x->by_off[m].start < start) lo=m+1; else hi=m; }
+    return lo;
+}
+// First run not smaller than `key` in (length, start) order
+static size_t ext_lb_size(const extent_index_t* x, extent_t key){
+    size_t lo=0, hi=x->n;
+    while (lo<hi){ size_t m=(lo+hi)/2; if (ext_size_less(x->by_size[m], key)) lo=m+1; else hi=m; }
+    return lo;
+}
+static void ext_insert(extent_index_t* x, extent_t e){
+    size_t i = ext_lb_off(x, e.start);
+    memmove(&x->by_off[i+1], &x->by_off[i], (x->n-i)*sizeof(extent_t));
+    x->by_off[i] = e;
+    i = ext_lb_size(x, e);
+    memmove(&x->by_size[i+1], &x->by_size[i], (x->n-i)*sizeof(extent_t));
+    x->by_size[i] = e;
+    x->n++;
+}
+static void ext_remove(extent_index_t* x, extent_t e){
+    size_t i = ext_lb_off(x, e.start);
+    memmove(&x->by_off[i], &x->by_off[i+1], (x->n-i-1)*sizeof(extent_t));
+    i = ext_lb_size(x, e);
+    memmove(&x->by_size[i], &x->by_size[i+1], (x->n-i-1)*sizeof(extent_t));
+    x->n--;
+}
+static int ext_build(extent_index_t* x, const uint8_t* bm, size_t bits){
+    x->n = 0;
+    x->by_off  = malloc((bits/2+1) * sizeof(extent_t));
+    x->by_size = malloc((bits/2+1) * sizeof(extent_t));
+    if (!x->by_off || !x->by_size) return 1;
+    metric_add(&metrics.bitmap_scan_bits, bits);
+    for (size_t i=0;i<bits;){
+        if (bitmap_test(bm,i)){ i++; continue; }
+        size_t j=i;
+        while (j<bits && !bitmap_test(bm,j)) j++;
+        ext_insert(x, (extent_t){ (uint32_t)i, (uint32_t)(j-i) });
+        i=j;
+    }
+    return 0;
+}
+// Start of the smallest free run of at least `len` blocks, or -1
+static long long ext_best_fit(const extent_index_t* x, uint32_t len){
+    size_t i = ext_lb_size(x, (extent_t){ 0, len });
+    return i < x->n ? (long long)x->by_size[i].start : -1;
+}
+// Remove [start, start+len) from the free run that contains it
+static void ext_take(extent_index_t* x, uint32_t start, uint32_t len){
+    extent_t e = x->by_off[ext_lb_off(x, start+1) - 1];
+    ext_remove(x, e);
+    if (start > e.start) ext_insert(x, (extent_t){ e.start, start - e.start });
+    if (start+len < e.start+e.len) ext_insert(x, (extent_t){ start+len, e.start+e.len - (start+len) });
 }
 
-int main(int argc, char** argv){
-    crc32_init();
+// ================= Merkle tree =================
+// Same layout as mkfs_builder: heap-ordered CRC32 nodes at MERKLE_OFFSET in
+// block 0, leaf i covering blocks [i*64, (i+1)*64) with block 0 skipped.
+// Only the leaves of groups holding a dirty block are rehashed, then the
+// path from each of them to the root.
+static uint32_t merkle_leaf(const uint8_t* img, uint64_t total_blocks, uint32_t leaf){
+    uint32_t blk_crc[MERKLE_GROUP_BLOCKS];
+    uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+    if (first >= total_blocks) return 0;
+    uint64_t n = total_blocks - first;
+    if (n > MERKLE_GROUP_BLOCKS) n = MERKLE_GROUP_BLOCKS;
+    for (uint64_t i=0;i<n;i++)
+        blk_crc[i] = (first+i == 0) ? 0 : crc32_finalize(img + (size_t)(first+i)*BS, BS);
+    metric_add(&metrics.crc_bytes, n * BS);
+    return crc32_finalize(blk_crc, (size_t)n * sizeof(uint32_t));
+}
 
-    const char* inpath=NULL;
-    const char* outpath=NULL;
-    const char* filepath=NULL;
+static void merkle_update(uint8_t* img, uint64_t total_blocks, const uint8_t* dirty){
+    uint32_t* tree = (uint32_t*)(img + MERKLE_OFFSET);
+    for (uint32_t leaf=0; leaf<MERKLE_LEAVES; leaf++){
+        uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+        int touched = 0;
+        for (uint64_t b=first; b<first+MERKLE_GROUP_BLOCKS && b<total_blocks; b++)
+            if (bitmap_test(dirty, (size_t)b)){ touched = 1; break; }
+        if (!touched) continue;
+        size_t n = MERKLE_LEAVES-1+leaf;
+        tree[n] = merkle_leaf(img, total_blocks, leaf);
+        while (n){
+            n = (n-1)/2;
+            tree[n] = crc32_finalize(&tree[2*n+1], 2*sizeof(uint32_t));
+        }
+    }
+}
 
-    // Simple manual CLI parsing
-    for (int i=1;i<argc;i++){
-        if (!strcmp(argv[i],"--input") && i+1<argc) inpath = argv[++i];
-        else if (!strcmp(argv[i],"--output") && i+1<argc) outpath = argv[++i];
-        else if (!strcmp(argv[i],"--file") && i+1<argc) filepath = argv[++i];
-        else { usage(argv[0]); return 2; }
-    }
-    if (!inpath || !outpath || !filepath){ usage(argv[0]); return 2; }
-
-    // Read whole image
-    FILE* fi = fopen(inpath, "rb");
-    if (!fi){ perror("open input"); return 1; }
-    if (fseek(fi, 0, SEEK_END) != 0){ perror("seek input"); fclose(fi); return 1; }
-    long isz = ftell(fi);
-    if (isz <= 0){ fprintf(stderr, "empty image\n"); fclose(fi); return 1; }
-    if (fseek(fi, 0, SEEK_SET) != 0){ perror("rewind input"); fclose(fi); return 1; }
-
-    uint8_t* img = (uint8_t*)malloc((size_t)isz);
-    if (!img){ fprintf(stderr,"oom\n"); fclose(fi); return 1; }
-    if (fread(img,1,(size_t)isz,fi)!=(size_t)isz){ perror("read image"); fclose(fi); free(img); return 1; }
-    fclose(fi);
-
-    // Map structures
-    superblock_t* sb = (superblock_t*)(img + 0);
-    if (sb->block_size != BS || sb->magic != 0x4D565346u){
+// ================= Image =================
+// The image is mapped MAP_PRIVATE: pages are read on first touch and only
+// the blocks a commit modifies are copied, instead of reading the whole file
+// up front. How the mapping is primed depends on the expected access:
+//   auto        small images are populated at map time; larger ones get
+//               WILLNEED on the metadata blocks and RANDOM on the data region
+//   random      no readahead anywhere, metadata still prefetched
+//   sequential  SEQUENTIAL + WILLNEED on everything (e.g. --dedup over
+//               many large files)
+// Metadata is at most a few dozen blocks, far below a 2 MiB huge page, so
+// MADV_HUGEPAGE staging would not buy anything for this format.
+#define POPULATE_MAX_BYTES (1u << 20)
+
+typedef enum { ACCESS_AUTO, ACCESS_RANDOM, ACCESS_SEQUENTIAL } access_t;
+
+typedef struct {
+    uint8_t*      img;        // whole image, mapped copy-on-write
+    size_t        size;
+    superblock_t* sb;
+    uint8_t*      inode_bm;
+    uint8_t*      data_bm;
+    inode_t*      itab;
+    inode_t*      root;
+    uint32_t      dir_block;  // root directory block
+    dirent64_t*   dent;
+    extent_index_t dfree;     // free runs of data_bm
+    uint8_t       dirty[BS];  // one bit per image block modified since load
+    int           verify;
+    uint8_t       verified[BS]; // one bit per metadata block checked so far
+} image_t;
+
+// ================= Verification =================
+// Checksums are checked lazily: the superblock when the image is opened,
+// each inode-table block and the directory block the first time anything
+// in it is used, remembering the result per block. Opening costs the same
+// however many inodes the image has, and no unchecked inode or dirent is
+// ever trusted. mkfs_builder computes the inode CRC over the first 120
+// bytes and mkfs_adder over all 128 (crc field zeroed in both); either is
+// accepted.
+static int superblock_ok(const superblock_t* sb){
+    superblock_t tmp = *sb;
+    tmp.checksum = 0;
+    return crc32_finalize(&tmp, sizeof(tmp)) == sb->checksum;
+}
+
+// Whether the root inode still carries mkfs_builder's 120-byte CRC. The
+// writers (mkfs_adder, mkfs_sync, mkfs_relayout) rewrite inodes in the
+// 128-byte form, and every commit rewrites the superblock checksum too, so
+// this marks an image no tool has changed since mkfs_builder made it.
+static int root_from_builder(const inode_t* root){
+    uint32_t c120, c128;
+    inode_crc_lanes(&root, 1, &c120, &c128);
+    return root->inode_crc == c120 && root->inode_crc != c128;
+}
+
+// A bad superblock checksum on an otherwise valid image is accepted, with a
+// warning, if nothing has written the image since mkfs_builder: builders
+// before the superblock checksum fix stored a value that never verifies.
+// Returns 0 to go on, 2 to reject.
+static int superblock_mismatch(const inode_t* root){
+    if (root_from_builder(root)){
+        fprintf(stderr,"warning: superblock checksum mismatch; accepting an image unchanged since mkfs_builder "
+                       "(older builders stored a bad checksum)\n");
+        return 0;
+    }
+    fprintf(stderr,"superblock checksum mismatch (--no-verify skips the checks)\n");
+    return 2;
+}
+
+// Returns 0 if block `blk` (inode table or directory) checks out, 2 if not
+static int image_verify_block(image_t* im, uint64_t blk){
+    if (!im->verify || bitmap_test(im->verified, (size_t)blk)) return 0;
+    const superblock_t* sb = im->sb;
+    if (blk >= sb->inode_table_start && blk < sb->inode_table_start + sb->inode_table_blocks){
+        uint64_t first = (blk - sb->inode_table_start) * (BS / INODE_SIZE);
+        uint64_t end = first + BS/INODE_SIZE < sb->inode_count ? first + BS/INODE_SIZE : sb->inode_count;
+        for (uint64_t i=first; i<end; ){
+            // Next CRC_LANES allocated inodes of the block
+            const inode_t* lane[CRC_LANES];
+            uint64_t idx[CRC_LANES];
+            size_t n = 0;
+            for (; i<end && n<CRC_LANES; i++)
+                if (bitmap_test(im->inode_bm, (size_t)i)){ idx[n] = i; lane[n++] = &im->itab[i]; }
+            if (!n) break;
+            uint32_t c120[CRC_LANES], c128[CRC_LANES];
+            inode_crc_lanes(lane, n, c120, c128);
+            metric_add(&metrics.crc_bytes, n * INODE_SIZE);
+            for (size_t l=0;l<n;l++){
+                if (lane[l]->inode_crc != c128[l] && lane[l]->inode_crc != c120[l]){
+                    fprintf(stderr,"inode #%llu checksum mismatch\n", (unsigned long long)idx[l]+1);
+                    return 2;
+                }
+            }
+        }
+    } else {
+        long bad = dirent_block_check(im->img + (size_t)blk * BS);
+        if (bad >= 0){
+            fprintf(stderr,"directory entry %ld in block %llu checksum mismatch\n", bad, (unsigned long long)blk);
+            return 2;
+        }
+    }
+    bitmap_set(im->verified, (size_t)blk);
+    return 0;
+}
+
+// Checked pointer to inode `ino` (1-based), NULL if it fails verification
+static inode_t* image_inode(image_t* im, uint32_t ino){
+    uint64_t blk = im->sb->inode_table_start + (ino-1) / (BS / INODE_SIZE);
+    return image_verify_block(im, blk) == 0 ? &im->itab[ino-1] : NULL;
+}
+
+// Returns 0 on success, 1 on I/O error, 2 if the file is not a usable image
+static int image_load(image_t* im, const char* path, access_t access, int verify){
+    memset(im, 0, sizeof(*im));
+    im->verify = verify;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){ perror("open input"); return 1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0){ perror("stat input"); close(fd); return 1; }
+    if (st.st_size <= 0){ fprintf(stderr, "empty image\n"); close(fd); return 1; }
+
+    im->size = (size_t)st.st_size;
+    int populate = access == ACCESS_SEQUENTIAL || (access == ACCESS_AUTO && im->size <= POPULATE_MAX_BYTES);
+    void* m = mmap(NULL, im->size, PROT_READ|PROT_WRITE, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    close(fd);
+    if (m == MAP_FAILED){ perror("map input"); im->size = 0; return 1; }
+    im->img = (uint8_t*)m;
+    if (access == ACCESS_SEQUENTIAL) madvise(im->img, im->size, MADV_SEQUENTIAL);
+
+    superblock_t* sb = im->sb = (superblock_t*)im->img;
+    if (im->size < BS || sb->block_size != BS || sb->magic != 0x4D565346u){
         fprintf(stderr,"not a MiniVSFS image\n");
-        free(img);
         return 2;
     }
-    uint8_t* inode_bm = img + (size_t)sb->inode_bitmap_start * BS;
-    uint8_t* data_bm  = img + (size_t)sb->data_bitmap_start  * BS;
-    inode_t* itab     = (inode_t*)(img + (size_t)sb->inode_table_start * BS);
+    // Decided once the rest of the metadata has checked out
+    int sb_bad = verify && !superblock_ok(sb);
+    if ((uint64_t)im->size < sb->total_blocks * BS){
+        fprintf(stderr,"image truncated\n");
+        return 2;
+    }
+    if (sb->total_blocks > (uint64_t)BS*8){
+        fprintf(stderr,"image too large\n");
+        return 2;
+    }
+    if ((sb->flags & SB_FLAG_MERKLE) && sb->total_blocks > (uint64_t)MERKLE_LEAVES*MERKLE_GROUP_BLOCKS){
+        fprintf(stderr,"image too large for its merkle tree\n");
+        return 2;
+    }
+    im->inode_bm = im->img + (size_t)sb->inode_bitmap_start * BS;
+    im->data_bm  = im->img + (size_t)sb->data_bitmap_start  * BS;
+    im->itab     = (inode_t*)(im->img + (size_t)sb->inode_table_start * BS);
+    if (!populate && sb->data_region_start < sb->total_blocks){
+        size_t meta = (size_t)sb->data_region_start * BS;
+        madvise(im->img + meta, im->size - meta, MADV_RANDOM);
+        madvise(im->img, meta, MADV_WILLNEED);
+    }
+    if (sb->inode_table_blocks * (BS / INODE_SIZE) < sb->inode_count ||
+        sb->inode_table_start + sb->inode_table_blocks > sb->total_blocks){
+        fprintf(stderr,"inode table out of range\n");
+        return 2;
+    }
+    if (!(im->root = image_inode(im, ROOT_INO))) return 2;
+    im->dir_block = im->root->direct[0];
+    if (im->dir_block < sb->data_region_start || im->dir_block >= sb->total_blocks){
+        fprintf(stderr,"root missing first data block\n");
+        return 2;
+    }
+    im->dent = (dirent64_t*)(im->img + (size_t)im->dir_block * BS);
+    if (image_verify_block(im, im->dir_block) != 0) return 2;
+    if (sb_bad && superblock_mismatch(im->root) != 0) return 2;
+    if (ext_build(&im->dfree, im->data_bm, (size_t)sb->data_region_blocks) != 0){
+        fprintf(stderr,"oom\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void image_free(image_t* im){
+    if (im->img) munmap(im->img, im->size);
+    free(im->dfree.by_off);
+    free(im->dfree.by_size);
+}
+
+static int block_is_zero(const uint8_t* p, size_t n){
+    return n == 0 || (p[0] == 0 && memcmp(p, p+1, n-1) == 0);
+}
+
+// The image goes to <path>.tmp, which is synced and then renamed over
+// <path>, so an interrupted write leaves the previous image intact. All-zero
+// blocks are skipped rather than written, leaving holes in the output file,
+// so images trimmed by mkfs_trim stay sparse across adds. With `lock_fd`,
+// the new file is locked (see image_lock()) before it is renamed into
+// place, and the lock then replaces *lock_fd, which named the old file.
+static int image_write(const image_t* im, const char* path, int* lock_fd){
+    size_t plen = strlen(path);
+    char* tmp = malloc(plen + 5);
+    if (!tmp){ fprintf(stderr,"oom\n"); return 1; }
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+    FILE* fo = fopen(tmp, "wb");
+    if (!fo){ perror("open output"); free(tmp); return 1; }
+    int lk = -1;
+    if (lock_fd && ((lk = fcntl(fileno(fo), F_DUPFD_CLOEXEC, 0)) < 0 || flock(lk, LOCK_EX) != 0)){
+        perror("lock output");
+        goto fail;
+    }
+    for (size_t off=0; off<im->size; off+=BS){
+        size_t n = im->size - off < BS ? im->size - off : BS;
+        if (block_is_zero(im->img + off, n)){
+            if (fseek(fo, (long)n, SEEK_CUR) != 0){ perror("seek output"); goto fail; }
+        } else if (fwrite(im->img + off,1,n,fo)!=n){ perror("write output"); goto fail; }
+        else metric_add(&metrics.blocks_written, 1);
+    }
+    if (fflush(fo) != 0 || ftruncate(fileno(fo), (off_t)im->size) != 0 || fsync(fileno(fo)) != 0){
+        perror("write output");
+        goto fail;
+    }
+    if (fclose(fo) != 0){ fo = NULL; perror("close output"); goto fail; }
+    if (rename(tmp, path) != 0){ perror("rename output"); fo = NULL; goto fail; }
+    if (lock_fd){
+        if (*lock_fd >= 0) close(*lock_fd);
+        *lock_fd = lk;
+    }
+    free(tmp);
+    return 0;
+fail:
+    if (fo) fclose(fo);
+    if (lk >= 0) close(lk);
+    remove(tmp);
+    free(tmp);
+    return 1;
+}
+
+#define IO_GAP_BLOCKS 4u   // clean blocks worth rewriting to save a syscall
+
+static int pwrite_all(int fd, const uint8_t* p, size_t n, off_t off){
+    while (n){
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0){ if (errno == EINTR) continue; return -1; }
+        p += w; n -= (size_t)w; off += w;
+    }
+    return 0;
+}
+
+// Whether a clean block can be rewritten to bridge a gap between dirty ones.
+// Not if it may be a hole (a free data block or an all-zero block, see
+// image_write() and mkfs_trim): writing it would allocate host disk space.
+static int block_bridgeable(const image_t* im, uint64_t b){
+    const superblock_t* sb = im->sb;
+    if (b >= sb->data_region_start && b - sb->data_region_start < sb->data_region_blocks &&
+        !bitmap_test(im->data_bm, (size_t)(b - sb->data_region_start))) return 0;
+    return !block_is_zero(im->img + (size_t)b*BS, BS);
+}
+
+// Write only the dirty blocks back to an image file that already holds the
+// rest. Dirty blocks are taken in block order and merged into runs, also
+// bridging gaps of up to IO_GAP_BLOCKS clean, non-hole blocks (the run is
+// split at a possible hole instead); each run is one
+// contiguous slice of the in-memory image, so it takes a single pwrite.
+// Block 0 (superblock, checkpoint, merkle root) goes last, after the other
+// runs are synced, so it never describes blocks that are not on disk yet.
+static int image_flush(const image_t* im, int fd){
+    uint64_t total = im->sb->total_blocks;
+    for (uint64_t b=1;b<total;){
+        if (!bitmap_test(im->dirty, (size_t)b)){ b++; continue; }
+        uint64_t e = b+1;   // run is [b, e)
+        for (uint64_t n=e; n<total && n<=e+IO_GAP_BLOCKS; n++){
+            if (bitmap_test(im->dirty, (size_t)n)) e = n+1;
+            else if (!block_bridgeable(im, n)) break;
+        }
+        if (pwrite_all(fd, im->img + (size_t)b*BS, (size_t)(e-b)*BS, (off_t)(b*BS)) != 0){ perror("write output"); return 1; }
+        metric_add(&metrics.blocks_written, e-b);
+        b = e;
+    }
+    if (fdatasync(fd) != 0){ perror("sync output"); return 1; }
+    if (pwrite_all(fd, im->img, BS, 0) != 0 || fdatasync(fd) != 0){ perror("write superblock"); return 1; }
+    metric_add(&metrics.blocks_written, 1);
+    return 0;
+}
+
+// Whether two paths name the same existing file
+static int same_file(const char* a, const char* b){
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// ================= Image lock =================
+// Every tool that modifies an image (mkfs_adder, mkfs_sync, mkfs_relayout,
+// mkfs_cat, mkfs_trim) holds an exclusive flock() on the image file from reading it to
+// finishing its commit, so no writer commits over blocks another has just
+// changed. Tools that replace the image by rename lock the new file before
+// the rename and hold the lock on the old one until it is done; a waiter that then gets the lock checks
+// that the path still names the file it locked, and otherwise locks the
+// new one. Returns the lock descriptor, or -1.
+static int image_lock(const char* path){
+    for (;;){
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0){ perror("open image"); return -1; }
+        if (flock(fd, LOCK_EX) != 0){ perror("lock image"); close(fd); return -1; }
+        struct stat a, b;
+        if (fstat(fd, &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) return fd;
+        close(fd);
+    }
+}
+static void image_unlock(int fd){ if (fd >= 0) close(fd); }
+
+static void image_mark_inode(image_t* im, uint32_t ino){
+    bitmap_set(im->dirty, (size_t)(im->sb->inode_table_start + (uint64_t)(ino-1) * INODE_SIZE / BS));
+}
 
-    // Read file to add
-    FILE* ff = fopen(filepath, "rb");
-    if (!ff){ perror("open file"); free(img); return 1; }
-    if (fseek(ff, 0, SEEK_END) != 0){ perror("seek file"); fclose(ff); free(img); return 1; }
-    long fsz = ftell(ff);
-    if (fsz < 0){ fprintf(stderr,"file size error\n"); fclose(ff); free(img); return 1; }
-    if (fseek(ff, 0, SEEK_SET) != 0){ perror("rewind file"); fclose(ff); free(img); return 1; }
+// Copy `size` bytes into the given blocks, zero-filling the tail of the last one
+static void image_write_blocks(image_t* im, const uint32_t* direct, uint64_t nblocks,
+                               const uint8_t* buf, uint64_t size){
+    for (uint64_t i=0;i<nblocks;i++){
+        uint8_t* blk = im->img + (size_t)direct[i] * BS;
+        size_t remain = (size > i*BS) ? (size_t)(size - i*BS) : 0;
+        size_t tocopy = (remain > BS) ? BS : remain;
+        if (tocopy) memcpy(blk, buf + (size_t)(i*BS), tocopy);
+        if (tocopy < BS) memset(blk+tocopy, 0, BS - tocopy);
+        bitmap_set(im->dirty, direct[i]);
+    }
+}
+
+// ================= Pending files =================
+// A file queued for this run. Without --delalloc its blocks are placed and
+// filled as soon as it is queued (first-fit, block by block). With --delalloc
+// only a block count is reserved; placement waits for commit, when every
+// pending file is known and each can be given one contiguous run.
+typedef struct {
+    const char* name;              // basename, points into argv
+    uint8_t*    buf;               // contents until placed, then NULL
+    uint64_t    size;
+    uint64_t    nblocks;
+    uint32_t    direct[DIRECT_MAX];
+    uint32_t    ino;               // assigned at commit
+    uint32_t    crc;               // contents CRC32, valid once crc_known is set
+    int         crc_known;
+    uint32_t    link_ino;          // --dedup: image inode with the same contents
+    long long   link_pend;         // --dedup: earlier pending file with the same contents, or -1
+} pending_t;
+
+// Read a whole host file. Returns 0, or an errno value with *what naming
+// the step that failed; nothing is printed, so it can run on any thread.
+// Files larger than `max` are refused with EFBIG (and their size in
+// *out_size) before anything is allocated, so one oversized input cannot
+// make the adder buffer gigabytes only to reject it afterwards
+static int load_host_file(const char* path, uint64_t max, uint8_t** out, uint64_t* out_size, const char** what){
+    FILE* ff = fopen(path, "rb");
+    if (!ff){ *what = "open file"; return errno; }
+    struct stat st;
+    if (fstat(fileno(ff), &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size > max){
+        fclose(ff);
+        *out_size = (uint64_t)st.st_size;
+        *what = "file too large";
+        return EFBIG;
+    }
+    long fsz = -1;
+    if (fseek(ff, 0, SEEK_END) != 0 || (fsz = ftell(ff)) < 0 || fseek(ff, 0, SEEK_SET) != 0){
+        int err = errno;
+        fclose(ff);
+        *what = "seek file";
+        return err ? err : EIO;
+    }
+    if ((uint64_t)fsz > max){
+        fclose(ff);
+        *out_size = (uint64_t)fsz;
+        *what = "file too large";
+        return EFBIG;
+    }
 
     uint8_t* fbuf = NULL;
     if (fsz > 0){
         fbuf = (uint8_t*)malloc((size_t)fsz);
-        if (!fbuf){ fprintf(stderr,"oom\n"); fclose(ff); free(img); return 1; }
-        if (fread(fbuf,1,(size_t)fsz,ff)!=(size_t)fsz){ perror("read file"); fclose(ff); free(fbuf); free(img); return 1; }
+        if (!fbuf){ fclose(ff); *what = "read file"; return ENOMEM; }
+        if (fread(fbuf,1,(size_t)fsz,ff)!=(size_t)fsz){
+            int err = ferror(ff) ? errno : EIO;
+            fclose(ff);
+            free(fbuf);
+            *what = "read file";
+            return err ? err : EIO;
+        }
     }
     fclose(ff);
+    *out = fbuf;
+    *out_size = (uint64_t)fsz;
+    return 0;
+}
 
-    // Find free inode
-    long long free_in = bitmap_ffz(inode_bm, (size_t)sb->inode_count);
-    if (free_in < 0){ fprintf(stderr,"no free inode available\n"); free(fbuf); free(img); return 1; }
-    if ((size_t)free_in >= sb->inode_count){ fprintf(stderr,"inode index OOB\n"); free(fbuf); free(img); return 1; }
-    uint32_t new_ino = (uint32_t)(free_in + 1); // 1-indexed
-
-    // Blocks needed
-    uint64_t blocks_needed = ((uint64_t)fsz + (BS-1)) / BS;
-    if (blocks_needed > DIRECT_MAX){
-        fprintf(stderr,"Error: file too large for MiniVSFS (needs %llu blocks, max %d / %d KiB)\n",
-                (unsigned long long)blocks_needed, DIRECT_MAX, DIRECT_MAX*(BS/1024));
-        free(fbuf); free(img); return 1;
-    }
-
-    // Allocate data blocks (first-fit)
-    uint32_t direct[DIRECT_MAX] = {0};
-    for (uint64_t i=0;i<blocks_needed;i++){
-        long long idx = bitmap_ffz(data_bm, (size_t)sb->data_region_blocks);
-        if (idx < 0){
-            fprintf(stderr,"no free data blocks\n");
-            free(fbuf); free(img); return 1;
-        }
-        bitmap_set(data_bm, (size_t)idx);
-        direct[i] = (uint32_t)(sb->data_region_start + (uint64_t)idx);
+static int read_host_file(const char* path, uint8_t** out, uint64_t* out_size){
+    const char* what = NULL;
+    int err = load_host_file(path, UINT64_MAX, out, out_size, &what);
+    if (err) fprintf(stderr, "%s: %s\n", what, strerror(err));
+    return err ? 1 : 0;
+}
+
+// ================= Read queue =================
+// Host files are read by a small thread pool while the main thread works
+// through a group in input order: the whole group is submitted as one batch
+// (one wakeup), and ioq_wait() only blocks until the file needed next has
+// been read. On slow storage (network file systems, cold disks) a group then
+// has up to --io-threads reads in flight instead of one. Errors are kept
+// with the request and reported by the main thread when it gets there, so
+// messages come out in input order. --io-threads 0 reads inline.
+//
+// Workers stay at most IOQ_AHEAD_PER_THREAD files per thread ahead of the
+// main thread (a credit is returned each time ioq_wait() hands a file over),
+// and no file larger than FILE_MAX_BYTES is ever buffered, so read-ahead
+// memory is bounded no matter how large the group or the inputs are.
+#define IOQ_THREADS_MAX 64
+#define IOQ_AHEAD_PER_THREAD 2
+#define FILE_MAX_BYTES ((uint64_t)DIRECT_MAX * BS)
+
+typedef struct {
+    const char* path;
+    uint8_t*    buf;       // owned by the request until taken
+    uint64_t    size;
+    int         err;       // load_host_file() result
+    const char* what;
+    int         done;
+} ioreq_t;
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t  submitted, completed;
+    ioreq_t*        req;
+    size_t          nreq;
+    size_t          next;      // first request no worker has taken yet
+    size_t          taken;     // requests handed to the main thread
+    size_t          ahead;     // read-ahead credits: next < taken + ahead
+    size_t          busy;      // requests being read right now
+    int             stop;
+    pthread_t       th[IOQ_THREADS_MAX];
+    int             nth;
+} ioq_t;
+
+static int ioq_load(ioreq_t* r){
+    uint64_t t0 = now_us();
+    int err = load_host_file(r->path, FILE_MAX_BYTES, &r->buf, &r->size, &r->what);
+    hist_record(&metrics.read_us, now_us() - t0);
+    if (!err) metric_add(&metrics.host_read_bytes, r->size);
+    return err;
+}
+
+static void* ioq_worker(void* arg){
+    ioq_t* q = arg;
+    pthread_mutex_lock(&q->mu);
+    for (;;){
+        while (!q->stop && (q->next == q->nreq || q->next >= q->taken + q->ahead))
+            pthread_cond_wait(&q->submitted, &q->mu);
+        if (q->stop) break;
+        ioreq_t* r = &q->req[q->next++];
+        q->busy++;
+        pthread_mutex_unlock(&q->mu);
+        int err = ioq_load(r);
+        pthread_mutex_lock(&q->mu);
+        r->err = err;
+        r->done = 1;
+        q->busy--;
+        pthread_cond_broadcast(&q->completed);
     }
+    pthread_mutex_unlock(&q->mu);
+    return NULL;
+}
 
-    // Root directory block pointer
-    inode_t* root = &itab[0];
-    uint32_t first_dir_block = root->direct[0];
-    if (!first_dir_block){
-        fprintf(stderr,"root missing first data block\n");
-        free(fbuf); free(img); return 1;
+static int ioq_start(ioq_t* q, int nthreads){
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->mu, NULL);
+    pthread_cond_init(&q->submitted, NULL);
+    pthread_cond_init(&q->completed, NULL);
+    q->ahead = (size_t)nthreads * IOQ_AHEAD_PER_THREAD;
+    for (; q->nth < nthreads; q->nth++)
+        if (pthread_create(&q->th[q->nth], NULL, ioq_worker, q) != 0){ fprintf(stderr,"cannot start reader threads\n"); return 1; }
+    return 0;
+}
+
+// Queue req[0..n); the previous batch must have been waited for in full
+static void ioq_submit(ioq_t* q, ioreq_t* req, size_t n){
+    for (size_t i=0;i<n;i++){ req[i].buf = NULL; req[i].done = 0; }
+    pthread_mutex_lock(&q->mu);
+    q->req = req;
+    q->nreq = n;
+    q->next = q->nth ? 0 : n;
+    q->taken = 0;
+    pthread_cond_broadcast(&q->submitted);
+    pthread_mutex_unlock(&q->mu);
+}
+
+// Block until `r` has been read (without threads: read it now)
+static void ioq_wait(ioq_t* q, ioreq_t* r){
+    if (!q->nth){
+        if (!r->done){ r->err = ioq_load(r); r->done = 1; }
+        return;
     }
-    uint8_t* dblk = img + (size_t)first_dir_block * BS;
-    dirent64_t* dent = (dirent64_t*)dblk;
-    size_t entries = BS / sizeof(dirent64_t);
+    pthread_mutex_lock(&q->mu);
+    if (!r->done) metric_add(&metrics.read_waits, 1);
+    while (!r->done) pthread_cond_wait(&q->completed, &q->mu);
+    q->taken++;
+    pthread_cond_broadcast(&q->submitted);
+    pthread_mutex_unlock(&q->mu);
+}
 
-    // Basename of the file (used for dup check + dirent + final printf)
-    const char* base = strrchr(filepath, '/');
-    base = base ? base+1 : filepath;
+// Stop taking requests, let reads in progress finish, and free whatever was
+// read but never taken
+static void ioq_cancel(ioq_t* q){
+    if (q->nth){
+        pthread_mutex_lock(&q->mu);
+        q->nreq = q->next;
+        while (q->busy) pthread_cond_wait(&q->completed, &q->mu);
+        pthread_mutex_unlock(&q->mu);
+    }
+    for (size_t i=0;i<q->nreq;i++){ free(q->req[i].buf); q->req[i].buf = NULL; }
+}
 
-    // Duplicate filename check & find free slot
-    long long slot = -1;
-    size_t used_entries = 0;
-    for (size_t i=0;i<entries; i++){
-        if (dent[i].inode_no != 0){
-            used_entries++;
-            if (strncmp(dent[i].name, base, sizeof(dent[i].name)) == 0){
-                fprintf(stderr, "Error: file '%s' already exists in root directory.\n", base);
-                free(fbuf); free(img); return 1;
-            }
-        } else if (slot < 0){
-            slot = (long long)i;
+static void ioq_stop(ioq_t* q){
+    pthread_mutex_lock(&q->mu);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->submitted);
+    pthread_mutex_unlock(&q->mu);
+    for (int i=0;i<q->nth;i++) pthread_join(q->th[i], NULL);
+    pthread_cond_destroy(&q->submitted);
+    pthread_cond_destroy(&q->completed);
+    pthread_mutex_destroy(&q->mu);
+}
+
+// Allocate blocks for a file: the best-fitting contiguous run when
+// `contiguous` is set and such a run exists, otherwise first-fit block by
+// block. Caller has checked that enough blocks are free.
+static void place_blocks(image_t* im, pending_t* p, int contiguous){
+    extent_index_t* x = &im->dfree;
+    long long run = contiguous && p->nblocks ? ext_best_fit(x, (uint32_t)p->nblocks) : -1;
+    if (run >= 0) ext_take(x, (uint32_t)run, (uint32_t)p->nblocks);
+    for (uint64_t i=0;i<p->nblocks;i++){
+        long long idx = run >= 0 ? run + (long long)i : (long long)x->by_off[0].start;
+        if (run < 0) ext_take(x, (uint32_t)idx, 1);
+        bitmap_set(im->data_bm, (size_t)idx);
+        p->direct[i] = (uint32_t)(im->sb->data_region_start + (uint64_t)idx);
+    }
+    image_write_blocks(im, p->direct, p->nblocks, p->buf, p->size);
+    free(p->buf);
+    p->buf = NULL;
+}
+
+// ================= Dedup =================
+// --dedup: a queued file whose contents match a file already in the image,
+// or one queued earlier in this run, becomes a hard link to that inode: a
+// directory entry and links+1, no new inode or data blocks. Candidates are
+// narrowed by size, then by CRC32 of the contents, and confirmed with a byte
+// compare. Image files are hashed lazily, at most once each.
+typedef struct {
+    uint32_t* crc;       // per inode index, valid where the `hashed` bit is set
+    uint8_t*  hashed;
+} dedup_index_t;
+
+static int blocks_valid(const image_t* im, const uint32_t* direct, uint64_t size){
+    uint64_t n = (size + (BS-1)) / BS;
+    if (n > DIRECT_MAX) return 0;
+    for (uint64_t i=0;i<n;i++)
+        if (direct[i] < im->sb->data_region_start || direct[i] >= im->sb->total_blocks) return 0;
+    return 1;
+}
+static uint32_t blocks_crc(const image_t* im, const uint32_t* direct, uint64_t size){
+    metric_add(&metrics.crc_bytes, size);
+    uint32_t c = 0xFFFFFFFFu;
+    for (uint64_t i=0; i*BS < size; i++){
+        size_t n = size - i*BS > BS ? BS : (size_t)(size - i*BS);
+        c = crc32_update(c, im->img + (size_t)direct[i]*BS, n);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+static int blocks_equal(const image_t* im, const uint32_t* direct, uint64_t size, const uint8_t* buf){
+    for (uint64_t i=0; i*BS < size; i++){
+        size_t n = size - i*BS > BS ? BS : (size_t)(size - i*BS);
+        if (memcmp(im->img + (size_t)direct[i]*BS, buf + (size_t)(i*BS), n) != 0) return 0;
+    }
+    return 1;
+}
+static uint32_t pending_crc(const image_t* im, pending_t* p){
+    if (!p->crc_known){
+        if (p->buf) metric_add(&metrics.crc_bytes, p->size);
+        p->crc = p->buf ? crc32_finalize(p->buf, (size_t)p->size) : blocks_crc(im, p->direct, p->size);
+        p->crc_known = 1;
+    }
+    return p->crc;
+}
+
+// Look for a copy of pend[np] (still in its read buffer) in the root
+// directory, then among the pending files before it. Returns 2 if an inode
+// it has to look at fails verification.
+static int dedup_lookup(image_t* im, dedup_index_t* dx, const dirent64_t* dent, size_t entries,
+                        pending_t* pend, size_t np){
+    pending_t* p = &pend[np];
+    for (size_t i=0;i<entries;i++){
+        uint32_t ino = dent[i].inode_no;
+        if (!ino || dent[i].type != 1 || ino > im->sb->inode_count) continue;
+        const inode_t* in = image_inode(im, ino);
+        if (!in) return 2;
+        if (in->size_bytes != p->size || in->links == UINT16_MAX || !blocks_valid(im, in->direct, p->size)) continue;
+        if (!bitmap_test(dx->hashed, ino-1)){
+            dx->crc[ino-1] = blocks_crc(im, in->direct, p->size);
+            bitmap_set(dx->hashed, ino-1);
+        }
+        if (dx->crc[ino-1] == pending_crc(im, p) && blocks_equal(im, in->direct, p->size, p->buf)){
+            p->link_ino = ino;
+            return 0;
         }
     }
-    if (slot < 0){
-        fprintf(stderr, "Error: root directory is full (max ~%zu files including . and ..).\n", entries);
-        free(fbuf); free(img); return 1;
+    for (size_t i=0;i<np;i++){
+        pending_t* q = &pend[i];
+        if (q->link_ino || q->link_pend >= 0 || q->size != p->size) continue;
+        if (pending_crc(im, q) != pending_crc(im, p)) continue;
+        if (q->buf ? memcmp(q->buf, p->buf, (size_t)p->size) == 0 : blocks_equal(im, q->direct, p->size, p->buf)){
+            p->link_pend = (long long)i;
+            return 0;
+        }
     }
+    return 0;
+}
+
+// ================= Inode placement =================
+// New inodes go next to their siblings rather than in the lowest free slot
+// anywhere: the goal is the inode-table block already holding most of the
+// directory's children (the directory's own block while it has none), and
+// the search fans out from there one block at a time. Listing a directory
+// and stat-ing its files then reads a few adjacent inode-table blocks.
+static uint64_t dir_goal_block(const image_t* im, uint32_t dir_ino, const dirent64_t* dent){
+    const uint32_t per = BS / INODE_SIZE;
+    const size_t entries = BS / sizeof(dirent64_t);
+    uint64_t best = (dir_ino - 1) / per;
+    size_t best_n = 0;
+    for (size_t i=0;i<entries;i++){
+        uint32_t ino = dent[i].inode_no;
+        if (!ino || ino == dir_ino || ino > im->sb->inode_count) continue;
+        size_t n = 0;
+        for (size_t j=0;j<entries;j++)
+            n += dent[j].inode_no && dent[j].inode_no != dir_ino && (dent[j].inode_no - 1) / per == (ino - 1) / per;
+        if (n > best_n){ best_n = n; best = (ino - 1) / per; }
+    }
+    return best;
+}
+
+// Lowest free inode index in the goal block, else in the nearest block to
+// it (goal, goal+1, goal-1, goal+2, ...); -1 if the table is full
+static long long inode_alloc_near(image_t* im, uint64_t goal){
+    const uint64_t per = BS / INODE_SIZE, n = im->sb->inode_count;
+    const uint64_t nblk = (n + per - 1) / per;
+    for (uint64_t d=0; d<2*nblk; d++){
+        uint64_t step = (d + 1) / 2;
+        if (!(d & 1) && step > goal) continue;
+        uint64_t b = (d & 1) ? goal + step : goal - step;
+        if (b >= nblk) continue;
+        for (uint64_t i=b*per; i<(b+1)*per && i<n; i++){
+            if (!bitmap_test(im->inode_bm, (size_t)i)){
+                bitmap_set(im->inode_bm, (size_t)i);
+                return (long long)i;
+            }
+        }
+    }
+    return -1;
+}
 
-    // Create inode for the new file
+// ================= Commit =================
+// Create inodes and directory entries for the queued files (placing any
+// deferred blocks first), then update the root inode, merkle tree and
+// superblock. Nothing reaches the disk until image_write().
+static void commit_pending(image_t* im, pending_t* pend, size_t npend, int delalloc){
+    superblock_t* sb = im->sb;
+    inode_t* root = im->root;
+    dirent64_t* dent = im->dent;
     time_t now = time(NULL);
-    inode_t* inode = &itab[free_in];
-    memset(inode, 0, sizeof(*inode));
-    inode->mode = 0100000;       // file
-    inode->links = 1;
-    inode->uid = 0;
-    inode->gid = 0;
-    inode->size_bytes = (uint64_t)fsz;
-    inode->proj_id = 14;         // group ID 14
-    inode->atime = inode->mtime = inode->ctime = (uint64_t)now;
-    for (int i = 0; i < DIRECT_MAX; i++) inode->direct[i] = direct[i];
-    inode_crc_finalize(inode);
-    bitmap_set(inode_bm, (size_t)free_in);
-
-    // Write file data to allocated blocks
-    for (uint64_t i=0;i<blocks_needed;i++){
-        uint32_t absb = direct[i];
-        uint8_t* blk = img + (size_t)absb * BS;
-        size_t remain = ((size_t)fsz > (size_t)(i*BS)) ? (size_t)fsz - (size_t)(i*BS) : 0;
-        size_t tocopy = (remain > BS) ? BS : remain;
-        if (tocopy) memcpy(blk, fbuf + (size_t)(i*BS), tocopy);
-        if (tocopy < BS) memset(blk+tocopy, 0, BS - tocopy);
+    uint64_t goal = dir_goal_block(im, ROOT_INO, dent);
+    for (size_t f=0; f<npend; f++){
+        pending_t* p = &pend[f];
+        if (p->link_ino || p->link_pend >= 0){
+            // Hard link to an identical file
+            p->ino = p->link_ino ? p->link_ino : pend[p->link_pend].ino;
+            inode_t* inode = &im->itab[p->ino-1];
+            inode->links += 1;
+            inode->ctime = (uint64_t)now;
+            image_mark_inode(im, p->ino);
+        } else {
+            if (delalloc) place_blocks(im, p, 1);
+
+            long long free_in = inode_alloc_near(im, goal);
+            goal = (uint64_t)free_in / (BS / INODE_SIZE);
+            p->ino = (uint32_t)(free_in + 1); // 1-indexed
+            inode_t* inode = &im->itab[free_in];
+            memset(inode, 0, sizeof(*inode));
+            inode->mode = 0100000;       // file
+            inode->links = 1;
+            inode->uid = 0;
+            inode->gid = 0;
+            inode->size_bytes = p->size;
+            inode->proj_id = 14;         // group ID 14
+            inode->atime = inode->mtime = inode->ctime = (uint64_t)now;
+            for (int i = 0; i < DIRECT_MAX; i++) inode->direct[i] = p->direct[i];
+            image_mark_inode(im, p->ino);
+        }
+
+        // Fill directory entry
+        size_t slot = 0;
+        while (dent[slot].inode_no != 0) slot++;
+        dirent64_t de;
+        memset(&de, 0, sizeof(de));
+        de.inode_no = p->ino;
+        de.type = 1; // file
+        strncpy(de.name, p->name, sizeof(de.name)-1);
+        dirent_checksum_finalize(&de);
+        dent[slot] = de;
+        root->links += 1;
     }
-    free(fbuf); // free(NULL) is safe if fsz==0
+    bitmap_set(im->dirty, im->dir_block);
 
-    // Fill directory entry
-    dirent64_t de;
-    memset(&de, 0, sizeof(de));
-    de.inode_no = new_ino;
-    de.type = 1; // file
-    strncpy(de.name, base, sizeof(de.name)-1);
-    dirent_checksum_finalize(&de);
-    dent[slot] = de;
+    // Inode CRCs, CRC_LANES at a time
+    for (size_t f=0; f<npend; f+=CRC_LANES){
+        inode_t* lane[CRC_LANES];
+        size_t n = npend - f < CRC_LANES ? npend - f : CRC_LANES;
+        for (size_t l=0;l<n;l++) lane[l] = &im->itab[pend[f+l].ino-1];
+        inode_crc_finalize_lanes(lane, n);
+        metric_add(&metrics.crc_bytes, n * INODE_SIZE);
+    }
 
     // Update root inode (. .. + files)
-    root->links += 1;
-    used_entries += 1;
+    size_t used_entries = 0;
+    for (size_t i=0;i<BS/sizeof(dirent64_t);i++) used_entries += dent[i].inode_no != 0;
     root->size_bytes = (uint64_t)(used_entries * sizeof(dirent64_t));
     inode_crc_finalize(root);
+    image_mark_inode(im, ROOT_INO);
+    bitmap_set(im->dirty, (size_t)sb->inode_bitmap_start);
+    bitmap_set(im->dirty, (size_t)sb->data_bitmap_start);
+
+    if (sb->flags & SB_FLAG_MERKLE) merkle_update(im->img, sb->total_blocks, im->dirty);
 
     // Update superblock mtime + checksum
     sb->mtime_epoch = (uint64_t)now;
     superblock_crc_finalize(sb);
+    bitmap_set(im->dirty, 0);
+}
+
+// ================= Checkpoint =================
+// Bulk runs (--commit-every) record their progress in block 0 after each
+// group commit, so it reaches the disk together with the superblock: the
+// index of the next input and a CRC32 of the whole input list. --resume
+// checks both, and that every committed input is in the root directory,
+// before skipping the inputs already committed.
+#define CKPT_OFFSET 1024u
+#define CKPT_MAGIC  0x4B43564Du   // "MVCK"
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t manifest_crc;        // CRC32 of the input paths, each followed by '\n'
+    uint64_t next_input;          // first input not yet committed
+    uint64_t total_inputs;
+    uint32_t reserved;
+    uint32_t crc;                 // CRC32 over this struct with crc=0
+} checkpoint_t;
+#pragma pack(pop)
+
+static uint32_t manifest_crc(const char** files, size_t n){
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i=0;i<n;i++){
+        c = crc32_update(c, files[i], strlen(files[i]));
+        c = crc32_update(c, "\n", 1);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
 
-    // Write output image
-    FILE* fo = fopen(outpath, "wb");
-    if (!fo){ perror("open output"); free(img); return 1; }
-    if (fwrite(img,1,(size_t)isz,fo)!=(size_t)isz){ perror("write output"); fclose(fo); free(img); return 1; }
-    fclose(fo);
-    free(img);
+static void checkpoint_write(image_t* im, uint32_t mcrc, size_t next, size_t total){
+    checkpoint_t ck = { CKPT_MAGIC, mcrc, (uint64_t)next, (uint64_t)total, 0, 0 };
+    ck.crc = crc32_finalize(&ck, sizeof(ck));
+    memcpy(im->img + CKPT_OFFSET, &ck, sizeof(ck));
+}
+
+// Returns the input to resume from, or -1 if the image does not match
+static long long checkpoint_resume(const image_t* im, const char** files, size_t nfiles){
+    checkpoint_t ck;
+    memcpy(&ck, im->img + CKPT_OFFSET, sizeof(ck));
+    uint32_t crc = ck.crc;
+    ck.crc = 0;
+    if (ck.magic != CKPT_MAGIC || crc32_finalize(&ck, sizeof(ck)) != crc){
+        fprintf(stderr, "Error: image has no ingest checkpoint\n");
+        return -1;
+    }
+    if (ck.total_inputs != nfiles || ck.manifest_crc != manifest_crc(files, nfiles) || ck.next_input > nfiles){
+        fprintf(stderr, "Error: input list differs from the one in the checkpoint\n");
+        return -1;
+    }
+    for (size_t f=0; f<ck.next_input; f++){
+        const char* base = strrchr(files[f], '/');
+        base = base ? base+1 : files[f];
+        size_t i = 0;
+        while (i < BS/sizeof(dirent64_t) &&
+               !(im->dent[i].inode_no && strncmp(im->dent[i].name, base, sizeof(im->dent[i].name)) == 0)) i++;
+        if (i == BS/sizeof(dirent64_t)){
+            fprintf(stderr, "Error: checkpointed file '%s' is missing from the image\n", base);
+            return -1;
+        }
+    }
+    return (long long)ck.next_input;
+}
+
+// Append the non-empty lines of `path` to the input list; lines point into *text
+static int read_list(const char* path, char** text, const char*** files, size_t* nfiles, size_t* cap){
+    uint8_t* buf = NULL;
+    uint64_t size = 0;
+    if (read_host_file(path, &buf, &size) != 0) return 1;
+    char* t = realloc(buf, (size_t)size + 1);
+    if (!t){ free(buf); fprintf(stderr,"oom\n"); return 1; }
+    t[size] = '\0';
+    *text = t;
+    for (char* line = t; *line; ){
+        char* nl = strchr(line, '\n');
+        if (nl) *nl = '\0';
+        if (*line){
+            if (*nfiles == *cap){
+                const char** v = realloc(*files, (*cap *= 2) * sizeof(**files));
+                if (!v){ fprintf(stderr,"oom\n"); return 1; }
+                *files = v;
+            }
+            (*files)[(*nfiles)++] = line;
+        }
+        if (!nl) break;
+        line = nl + 1;
+    }
+    return 0;
+}
 
-    fprintf(stdout, "Added '%s' as inode #%u using %llu block(s) -> wrote '%s'\n",
-            base, new_ino, (unsigned long long)blocks_needed, outpath);
+// ================= Metrics file =================
+// Written to <path>.tmp and renamed over <path>, so a scraper never sees a
+// half-written file. Bulk runs rewrite it after every group commit. `im` is
+// NULL when the image could not be loaded; the space gauges are left out.
+static int metrics_write(const char* path, const image_t* im, const char* image){
+    size_t plen = strlen(path);
+    char* tmp = malloc(plen + 5);
+    if (!tmp){ fprintf(stderr,"oom\n"); return 1; }
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+    FILE* f = fopen(tmp, "w");
+    if (!f){ perror("open metrics"); free(tmp); return 1; }
+    prom_counter(f, "files_added_total", "Files added with new inodes.", image, metric_get(&metrics.files_added));
+    prom_counter(f, "files_linked_total", "Files added as hard links by --dedup.", image, metric_get(&metrics.files_linked));
+    prom_counter(f, "bytes_added_total", "File bytes added.", image, metric_get(&metrics.bytes_added));
+    prom_counter(f, "commits_total", "Group commits written.", image, metric_get(&metrics.commits));
+    prom_counter(f, "blocks_written_total", "Image blocks written to the output.", image, metric_get(&metrics.blocks_written));
+    prom_counter(f, "host_read_bytes_total", "Bytes read from input files.", image, metric_get(&metrics.host_read_bytes));
+    prom_counter(f, "read_waits_total", "Times the main thread waited for the read queue.", image, metric_get(&metrics.read_waits));
+    prom_counter(f, "crc_bytes_total", "Bytes checksummed with CRC32.", image, metric_get(&metrics.crc_bytes));
+    prom_counter(f, "bitmap_scan_bits_total", "Bitmap bits scanned.", image, metric_get(&metrics.bitmap_scan_bits));
+    prom_hist(f, "read_seconds", "Time to read one input file.", image, &metrics.read_us);
+    prom_hist(f, "commit_seconds", "Time to commit and write one group.", image, &metrics.commit_us);
+    if (im){
+        const superblock_t* sb = im->sb;
+        prom_gauge(f, "data_blocks", "Data region size in blocks.", image, sb->data_region_blocks);
+        prom_gauge(f, "data_blocks_free", "Free data blocks.", image, bitmap_count_zero(im->data_bm, (size_t)sb->data_region_blocks));
+        prom_gauge(f, "inodes", "Inode table size.", image, sb->inode_count);
+        prom_gauge(f, "inodes_free", "Free inodes.", image, bitmap_count_zero(im->inode_bm, (size_t)sb->inode_count));
+    }
+    int bad = ferror(f);
+    if (fclose(f) != 0 || bad || rename(tmp, path) != 0){
+        perror("write metrics");
+        remove(tmp);
+        free(tmp);
+        return 1;
+    }
+    free(tmp);
     return 0;
 }
 
+// ================= I/O priority =================
+// --background puts all of this process's I/O (host file reads, image
+// writes, syncs; threads started later inherit it) in the lowest
+// best-effort priority level. Block-layer schedulers that honour I/O
+// priorities (BFQ, mq-deadline) then serve readers of the image such as
+// mkfs_cat first, and this run takes the bandwidth they leave idle. Where
+// priorities are not supported it only costs a warning.
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_WHO_PROCESS 1
+
+static void io_background(void){
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7) != 0)
+        perror("ioprio_set (continuing at normal I/O priority)");
+}
+
+// ================= CLI =================
+static void usage(const char* prog){
+    fprintf(stderr,
+        "Usage: %s --input in.img --output out.img (--file <path> ... | --files-from <list>)\n"
+        "          [--delalloc] [--dedup] [--commit-every <n> [--resume]]\n"
+        "          [--access auto|random|sequential] [--no-verify] [--io-threads <n>]\n"
+        "          [--background] [--metrics <file>]\n", prog);
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+
+    const char* inpath=NULL;
+    const char* outpath=NULL;
+    const char* listpath=NULL;
+    size_t cap = (size_t)argc + 16;
+    const char** files = calloc(cap, sizeof(*files));
+    char* listtext = NULL;
+    size_t nfiles = 0;
+    int delalloc = 0;
+    int dedup = 0;
+    int resume = 0;
+    long commit_every = 0;
+    access_t access = ACCESS_AUTO;
+    int verify = 1;
+    long io_threads = 4;
+    int background = 0;
+    const char* metrics_path = NULL;
+    if (!files){ fprintf(stderr,"oom\n"); return 1; }
+
+    // Simple manual CLI parsing
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--input") && i+1<argc) inpath = argv[++i];
+        else if (!strcmp(argv[i],"--output") && i+1<argc) outpath = argv[++i];
+        else if (!strcmp(argv[i],"--file") && i+1<argc) files[nfiles++] = argv[++i];
+        else if (!strcmp(argv[i],"--files-from") && i+1<argc) listpath = argv[++i];
+        else if (!strcmp(argv[i],"--delalloc")) delalloc = 1;
+        else if (!strcmp(argv[i],"--dedup")) dedup = 1;
+        else if (!strcmp(argv[i],"--commit-every") && i+1<argc) commit_every = strtol(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i],"--resume")) resume = 1;
+        else if (!strcmp(argv[i],"--no-verify")) verify = 0;
+        else if (!strcmp(argv[i],"--background")) background = 1;
+        else if (!strcmp(argv[i],"--io-threads") && i+1<argc) io_threads = strtol(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i],"--metrics") && i+1<argc) metrics_path = argv[++i];
+        else if (!strcmp(argv[i],"--access") && i+1<argc){
+            const char* a = argv[++i];
+            if (!strcmp(a,"auto")) access = ACCESS_AUTO;
+            else if (!strcmp(a,"random")) access = ACCESS_RANDOM;
+            else if (!strcmp(a,"sequential")) access = ACCESS_SEQUENTIAL;
+            else { usage(argv[0]); free(files); return 2; }
+        }
+        else { usage(argv[0]); free(files); return 2; }
+    }
+    if (listpath && read_list(listpath, &listtext, &files, &nfiles, &cap) != 0){ free(listtext); free(files); return 1; }
+    if (!inpath || !outpath || !nfiles || commit_every < 0 || (resume && !commit_every) ||
+        io_threads < 0 || io_threads > IOQ_THREADS_MAX){
+        usage(argv[0]);
+        free(listtext);
+        free(files);
+        return 2;
+    }
+
+    if (background) io_background();
+    size_t group = commit_every ? (size_t)commit_every : nfiles;
+    if (group > nfiles) group = nfiles;
+    image_t* im = calloc(1, sizeof(*im));
+    pending_t* pend = calloc(group, sizeof(*pend));
+    ioreq_t* reqs = calloc(group, sizeof(*reqs));
+    size_t npend = 0;
+    dedup_index_t dx = {0};
+    ioq_t ioq;
+    int ioq_running = 0;
+    int out_fd = -1;
+    int loaded = 0;
+    int lock_fd = -1;
+    int rc = 1;
+    if (!im || !pend || !reqs){ fprintf(stderr,"oom\n"); goto out; }
+    // Held for the whole run, and moved to each new file image_write() renames
+    // into place (an existing output is the image being changed)
+    struct stat ost;
+    if (stat(outpath, &ost) == 0 && (lock_fd = image_lock(outpath)) < 0) goto out;
+    if ((rc = image_load(im, inpath, access, verify)) != 0) goto out;
+    loaded = 1;
+    rc = 1;
+    superblock_t* sb = im->sb;
+    dirent64_t* dent = im->dent;
+    size_t entries = BS / sizeof(dirent64_t);
+    if (dedup){
+        dx.crc    = calloc((size_t)sb->inode_count, sizeof(uint32_t));
+        dx.hashed = calloc((size_t)(sb->inode_count + 7) / 8, 1);
+        if (!dx.crc || !dx.hashed){ fprintf(stderr,"oom\n"); goto out; }
+    }
+
+    // A single commit onto the input file writes only its dirty blocks, in
+    // place. Checkpointed runs (--commit-every) always write a full copy
+    // and rename it over the output: an in-place flush cut short between
+    // the data runs and block 0 would leave entries on disk that the
+    // checkpoint does not cover, and --resume would then refuse them.
+    if (!commit_every && same_file(inpath, outpath) && (out_fd = open(outpath, O_RDWR)) < 0){ perror("open output"); goto out; }
+
+    // A single file is read inline; no point starting threads for it
+    ioq_running = 1;
+    if (ioq_start(&ioq, group > 1 ? (int)(io_threads < (long)group ? io_threads : (long)group) : 0) != 0) goto out;
+
+    uint32_t mcrc = manifest_crc(files, nfiles);
+    size_t next = 0;
+    if (resume){
+        long long r = checkpoint_resume(im, files, nfiles);
+        if (r < 0) goto out;
+        next = (size_t)r;
+        fprintf(stdout, "Resuming at input %zu of %zu\n", next + 1, nfiles);
+    }
+
+    // One group commit per `group` inputs (all of them without --commit-every)
+    while (next < nfiles){
+        size_t end = nfiles - next > group ? next + group : nfiles;
+        size_t used_entries = 0;
+        for (size_t i=0;i<entries;i++) used_entries += dent[i].inode_no != 0;
+        size_t free_inodes = bitmap_count_zero(im->inode_bm, (size_t)sb->inode_count);
+        size_t free_blocks = bitmap_count_zero(im->data_bm, (size_t)sb->data_region_blocks);
+        size_t new_inodes = 0;
+        for (size_t f=next; f<end; f++) reqs[f-next].path = files[f];
+        ioq_submit(&ioq, reqs, end - next);
+
+        // Queue the group: checks, reservations and (without --delalloc) placement
+        for (size_t f=next; f<end; f++){
+            // Basename of the file (used for dup check + dirent + final printf)
+            const char* base = strrchr(files[f], '/');
+            base = base ? base+1 : files[f];
+
+            for (size_t i=0;i<entries;i++){
+                if (dent[i].inode_no != 0 && strncmp(dent[i].name, base, sizeof(dent[i].name)) == 0){
+                    fprintf(stderr, "Error: file '%s' already exists in root directory.\n", base);
+                    goto out;
+                }
+            }
+            for (size_t i=0;i<npend;i++){
+                if (strncmp(pend[i].name, base, sizeof(dent[0].name)) == 0){
+                    fprintf(stderr, "Error: file '%s' given more than once.\n", base);
+                    goto out;
+                }
+            }
+            if (used_entries + npend >= entries){
+                fprintf(stderr, "Error: root directory is full (max ~%zu files including . and ..).\n", entries);
+                goto out;
+            }
+
+            pending_t* p = &pend[npend];
+            memset(p, 0, sizeof(*p));
+            p->name = base;
+            p->link_pend = -1;
+            ioreq_t* r = &reqs[f-next];
+            ioq_wait(&ioq, r);
+            if (r->err == EFBIG){
+                fprintf(stderr,"Error: file too large for MiniVSFS (needs %llu blocks, max %d / %d KiB)\n",
+                        (unsigned long long)((r->size + (BS-1)) / BS), DIRECT_MAX, DIRECT_MAX*(BS/1024));
+                goto out;
+            }
+            if (r->err){ fprintf(stderr, "%s: %s\n", r->what, strerror(r->err)); goto out; }
+            p->buf = r->buf;
+            p->size = r->size;
+            r->buf = NULL;
+            npend++;
+            if (dedup){
+                if (dedup_lookup(im, &dx, dent, entries, pend, npend-1) != 0){ rc = 2; goto out; }
+                if (p->link_ino || p->link_pend >= 0) continue;
+            }
+            if (new_inodes++ >= free_inodes){ fprintf(stderr,"no free inode available\n"); goto out; }
+
+            // Blocks needed
+            p->nblocks = (p->size + (BS-1)) / BS;
+            if (p->nblocks > DIRECT_MAX){
+                fprintf(stderr,"Error: file too large for MiniVSFS (needs %llu blocks, max %d / %d KiB)\n",
+                        (unsigned long long)p->nblocks, DIRECT_MAX, DIRECT_MAX*(BS/1024));
+                goto out;
+            }
+            if (p->nblocks > free_blocks){ fprintf(stderr,"no free data blocks\n"); goto out; }
+            free_blocks -= (size_t)p->nblocks;
+            if (!delalloc) place_blocks(im, p, 0);
+        }
+
+        uint64_t t0 = now_us();
+        commit_pending(im, pend, npend, delalloc);
+        if (commit_every) checkpoint_write(im, mcrc, end, nfiles);
+
+        // Write output image
+        if (out_fd >= 0){
+            if (image_flush(im, out_fd) != 0) goto out;
+        } else {
+            if (image_write(im, outpath, &lock_fd) != 0) goto out;
+        }
+        hist_record(&metrics.commit_us, now_us() - t0);
+        metric_add(&metrics.commits, 1);
+
+        for (size_t f=0; f<npend; f++){
+            if (pend[f].link_ino || pend[f].link_pend >= 0){
+                fprintf(stdout, "Linked '%s' to inode #%u (same contents) -> wrote '%s'\n",
+                        pend[f].name, pend[f].ino, outpath);
+                metric_add(&metrics.files_linked, 1);
+            } else {
+                fprintf(stdout, "Added '%s' as inode #%u using %llu block(s) -> wrote '%s'\n",
+                        pend[f].name, pend[f].ino, (unsigned long long)pend[f].nblocks, outpath);
+                metric_add(&metrics.files_added, 1);
+            }
+            metric_add(&metrics.bytes_added, pend[f].size);
+            free(pend[f].buf);
+        }
+        fflush(stdout);
+        npend = 0;
+        memset(im->dirty, 0, sizeof(im->dirty));
+        next = end;
+        if (metrics_path && next < nfiles) metrics_write(metrics_path, im, outpath);
+    }
+    rc = 0;
+
+out:
+    if (ioq_running){ ioq_cancel(&ioq); ioq_stop(&ioq); }
+    if (metrics_path && metrics_write(metrics_path, loaded ? im : NULL, outpath) != 0 && rc == 0) rc = 1;
+    free(reqs);
+    if (out_fd >= 0) close(out_fd);
+    image_unlock(lock_fd);
+    for (size_t f=0; f<npend; f++) free(pend[f].buf);
+    free(pend);
+    free(dx.crc);
+    free(dx.hashed);
+    if (im) image_free(im);
+    free(im);
+    free(listtext);
+    free(files);
+    return rc;
+}
@@ -4,7 +4,10 @@
    gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o mkfs_builder
 
  Usage:
-   ./mkfs_builder --image out.img --size-kib <180..4096> --inodes <128..512>
+   ./mkfs_builder --image out.img --size-kib <180..4096> --inodes <128..512> [--merkle]
+
+ --merkle stores a hash tree over the image blocks in the tail of block 0
+ (see "Merkle tree" below) and sets SB_FLAG_MERKLE; mkfs_adder keeps it current.
 */
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
@@ -22,6 +25,12 @@
 #define ROOT_INO 1u
 #define DIRECT_MAX 12
 
+#define SB_FLAG_MERKLE      0x1u    // superblock_t.flags: hash tree present
+#define MERKLE_GROUP_BLOCKS 64u     // blocks hashed into one leaf
+#define MERKLE_LEAVES       16u     // 4096 KiB max image / 64 blocks per leaf
+#define MERKLE_NODES        (2*MERKLE_LEAVES-1)
+#define MERKLE_OFFSET       2048u   // byte offset of the node array in block 0
+
 // ============================ Helpers / CRC ============================
 #pragma pack(push,1)
 typedef struct {
@@ -96,7 +105,9 @@ uint32_t crc32(const void* data, size_t n){
 // WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
 static uint32_t superblock_crc_finalize(superblock_t *sb) {
     sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
+    // Over the struct itself (as mkfs_adder does): BS - 4 bytes read far past
+    // it, so the stored value depended on whatever followed it on the stack
+    uint32_t s = crc32((void *) sb, sizeof(*sb));
     sb->checksum = s;
     return s;
 }
@@ -129,10 +140,31 @@ static inline int bitmap_test(const uint8_t* bm, size_t idx){
     return (bm[idx>>3] >> (idx & 7u)) & 1u;
 }
 
+// ============================ Merkle tree ============================
+// Nodes are heap-ordered (node 0 is the root, children of n are 2n+1 and 2n+2)
+// and live at MERKLE_OFFSET in block 0. Leaf i is the CRC32 of the per-block
+// CRC32s of blocks [i*64, (i+1)*64); block 0 is skipped since the superblock
+// carries its own checksum, and leaves past the end of the image stay 0.
+// Internal nodes are the CRC32 of their two children.
+static uint32_t merkle_leaf(const uint32_t* blk_crc, uint64_t total_blocks, uint32_t leaf){
+    uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+    if (first >= total_blocks) return 0;
+    uint64_t n = total_blocks - first;
+    if (n > MERKLE_GROUP_BLOCKS) n = MERKLE_GROUP_BLOCKS;
+    return crc32(blk_crc + first, (size_t)n * sizeof(uint32_t));
+}
+
+static void merkle_build(uint32_t* tree, const uint32_t* blk_crc, uint64_t total_blocks){
+    for (uint32_t i=0;i<MERKLE_LEAVES;i++)
+        tree[MERKLE_LEAVES-1+i] = merkle_leaf(blk_crc, total_blocks, i);
+    for (int n=(int)MERKLE_LEAVES-2;n>=0;n--)
+        tree[n] = crc32(&tree[2*n+1], 2*sizeof(uint32_t));
+}
+
 // ============================ CLI ============================
 static void usage(const char* prog){
     fprintf(stderr,
-        "Usage: %s --image <out.img> --size-kib <180..4096> --inodes <128..512>\n",
+        "Usage: %s --image <out.img> --size-kib <180..4096> --inodes <128..512> [--merkle]\n",
         prog);
 }
 
@@ -141,10 +173,12 @@ int main(int argc, char** argv){
     const char* image = NULL;
     long size_kib = -1;
     long inode_count = -1;
+    int merkle = 0;
     for (int i=1;i<argc;i++){
         if (!strcmp(argv[i], "--image") && i+1<argc){ image = argv[++i]; }
         else if (!strcmp(argv[i], "--size-kib") && i+1<argc){ size_kib = strtol(argv[++i], NULL, 10); }
         else if (!strcmp(argv[i], "--inodes") && i+1<argc){ inode_count = strtol(argv[++i], NULL, 10); }
+        else if (!strcmp(argv[i], "--merkle")){ merkle = 1; }
         else { usage(argv[0]); return 2; }
     }
     if (!image || size_kib<180 || size_kib>4096 || (size_kib%4)!=0 ||
@@ -165,10 +199,10 @@ int main(int argc, char** argv){
     if (data_region_start >= total_blocks){ fprintf(stderr,"invalid layout\n"); return 2; }
     const uint64_t data_region_blocks = total_blocks - data_region_start;
 
-    // Allocate in-memory image pieces
+    // Allocate in-memory image pieces (inode table rounded up to whole blocks)
     uint8_t* inode_bm = calloc(1, BS);
     uint8_t* data_bm  = calloc(1, BS);
-    inode_t* itab     = calloc(inode_count, sizeof(inode_t));
+    inode_t* itab     = calloc(inode_table_blocks * (BS/INODE_SIZE), sizeof(inode_t));
     uint8_t* data     = calloc(data_region_blocks, BS);
     if (!inode_bm || !data_bm || !itab || !data){
         fprintf(stderr, "oom\n"); return 1;
@@ -224,7 +258,7 @@ int main(int argc, char** argv){
     sb.data_region_blocks = data_region_blocks;
     sb.root_inode = ROOT_INO;
     sb.mtime_epoch = (uint64_t)now;
-    sb.flags = 0;
+    sb.flags = merkle ? SB_FLAG_MERKLE : 0;
     sb.checksum = 0;
     superblock_crc_finalize(&sb);
 
@@ -236,6 +270,20 @@ int main(int argc, char** argv){
     uint8_t zero[BS]; memset(zero,0,sizeof(zero));
     uint8_t sbpad[BS]; memset(sbpad,0,sizeof(sbpad));
     memcpy(sbpad, &sb, sizeof(sb));
+    if (merkle){
+        uint32_t* blk_crc = calloc(total_blocks, sizeof(uint32_t));
+        if (!blk_crc){ fprintf(stderr, "oom\n"); return 1; }
+        for (uint64_t b=1;b<total_blocks;b++){
+            const uint8_t* p;
+            if (b == inode_bitmap_start)     p = inode_bm;
+            else if (b == data_bitmap_start) p = data_bm;
+            else if (b < data_region_start)  p = (const uint8_t*)itab + (b - inode_table_start)*BS;
+            else                             p = data + (b - data_region_start)*BS;
+            blk_crc[b] = crc32(p, BS);
+        }
+        merkle_build((uint32_t*)(sbpad + MERKLE_OFFSET), blk_crc, total_blocks);
+        free(blk_crc);
+    }
     if (fwrite(sbpad,1,BS,f)!=BS){ perror("write sb"); return 1; }
 
     // block 1: inode bitmap
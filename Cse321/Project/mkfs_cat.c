@@ -0,0 +1,992 @@
+/*
+ Build:
+   gcc -O2 -std=c17 -Wall -Wextra mkfs_cat.c -o mkfs_cat
+
+ Usage:
+   ./mkfs_cat --image fs.img [--atime noatime|relatime|strict] [--lazytime [--flush-secs <n>]]
+              [--trace <read log>] [--stats] [--metrics <file>] [--crc32]
+              [--no-verify] (<name> ... | -)
+
+ Writes the named files from the image's root directory to stdout, like
+ cat(1). With "-" it keeps reading names from stdin, one per line, and
+ serves each as it arrives. Checksums are verified lazily, as in
+ mkfs_adder: the superblock on open, each inode-table block and the
+ directory block when first used. --no-verify skips the checks, as it does
+ in mkfs_adder (e.g. for images from an mkfs_builder older than its
+ superblock checksum fix).
+ Name lookups and inodes are cached (bounded LRU, negative entries too), and
+ the caches are dropped whenever the image file is changed by another tool.
+
+ Reading a file can update its atime, and every update dirties an
+ inode-table block, its inode CRC, the merkle tree and the superblock:
+   noatime   never update atime;
+   relatime  (default) update only if atime is not newer than mtime/ctime,
+             or is more than a day old, so a file read over and over costs
+             at most one metadata write a day;
+   strict    update on every read.
+ Reading never needs write access: if the image cannot be opened for
+ writing (read-only file or mount), atime is left alone, with a warning,
+ unless --atime strict was given, which then fails.
+ Without --lazytime each update is committed in place right after the read.
+ With --lazytime updates only change the in-memory inode and are written
+ back together: every --flush-secs seconds (0, the default, means never)
+ while reading names from stdin, and once at exit. A read-heavy session
+ then makes at most one metadata commit per flush interval. Commits take
+ the exclusive flock() every image writer holds (see mkfs_adder); if
+ another tool changed the image after the updates were made, they are
+ dropped instead of being written over its changes.
+
+ Contents are never copied: each file goes to stdout with one writev() of
+ spans pointing into the mapped image (see read_spans()). --crc32 prints
+ "<crc32>  <name>" per file instead, hashing the spans in place.
+
+ --trace appends the name of every file read to a log that mkfs_relayout
+ --trace can replay. --stats prints counters to stderr at exit. --metrics
+ writes the same counters to <file> in the Prometheus text format (as
+ mkfs_adder --metrics does) at exit, and every METRICS_EVERY_SECS seconds
+ while reading names from stdin.
+*/
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+
+#define SB_FLAG_MERKLE      0x1u    // superblock_t.flags: hash tree present
+#define MERKLE_GROUP_BLOCKS 64u     // blocks hashed into one leaf
+#define MERKLE_LEAVES       16u     // 4096 KiB max image / 64 blocks per leaf
+#define MERKLE_OFFSET       2048u   // byte offset of the node array in block 0
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;        // 1=file, 2=dir
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+#pragma pack(pop)
+
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+#define DIR_ENTRIES (BS / sizeof(dirent64_t))
+
+// ================= CRC32 (same definitions as mkfs_adder) =================
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for (int j=0;j<8;j++){
+            c = (c&1)? (0xEDB88320u ^ (c>>1)) : (c>>1);
+        }
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32_finalize(const void*buf, size_t len){
+    const uint8_t* p=(const uint8_t*)buf;
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i=0;i<len;i++) c = CRC32_TAB[(c ^ p[i]) & 0xFFu] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+static void superblock_crc_finalize(superblock_t* sb){
+    sb->checksum = 0;
+    sb->checksum = crc32_finalize(sb, sizeof(*sb));
+}
+static void inode_crc_finalize(inode_t* in){
+    in->inode_crc = 0;
+    in->inode_crc = (uint64_t)crc32_finalize(in, sizeof(*in));
+}
+
+// ================= Bitmap helpers =================
+static inline void bitmap_set(uint8_t* bm, size_t idx){ bm[idx>>3] |= (uint8_t)(1u << (idx & 7u)); }
+static inline int  bitmap_test(const uint8_t* bm, size_t idx){ return (bm[idx>>3] >> (idx & 7u)) & 1u; }
+
+// ================= Batch checksums =================
+// A table-driven CRC32 is one long dependency chain per buffer: each byte
+// waits for the previous lookup. Inodes are small and independent, so these
+// run CRC_LANES of them side by side, interleaving the chains so their
+// lookups overlap. An inode's 120-byte CRC (mkfs_builder) is the running
+// value after its first 120 bytes and its 128-byte CRC (mkfs_adder) is the
+// same chain continued over the zeroed crc field, so one pass yields both.
+#define CRC_LANES 4
+
+// n <= CRC_LANES inodes; c120/c128 may be NULL
+static void inode_crc_lanes(const inode_t* const* in, size_t n, uint32_t* c120, uint32_t* c128){
+    const uint8_t* p[CRC_LANES];
+    for (size_t l=0;l<CRC_LANES;l++) p[l] = (const uint8_t*)in[l < n ? l : 0];
+    uint32_t c0 = 0xFFFFFFFFu, c1 = c0, c2 = c0, c3 = c0;
+    const size_t body = offsetof(inode_t, inode_crc);
+    for (size_t i=0;i<body;i++){
+        c0 = CRC32_TAB[(c0 ^ p[0][i]) & 0xFFu] ^ (c0>>8);
+        c1 = CRC32_TAB[(c1 ^ p[1][i]) & 0xFFu] ^ (c1>>8);
+        c2 = CRC32_TAB[(c2 ^ p[2][i]) & 0xFFu] ^ (c2>>8);
+        c3 = CRC32_TAB[(c3 ^ p[3][i]) & 0xFFu] ^ (c3>>8);
+    }
+    uint32_t c[CRC_LANES] = { c0, c1, c2, c3 };
+    for (size_t l=0;l<n;l++){
+        if (c120) c120[l] = c[l] ^ 0xFFFFFFFFu;
+        if (c128){
+            uint32_t x = c[l];
+            for (size_t i=body;i<INODE_SIZE;i++) x = CRC32_TAB[x & 0xFFu] ^ (x>>8);
+            c128[l] = x ^ 0xFFFFFFFFu;
+        }
+    }
+}
+
+// A dirent's checksum byte is the XOR of its other 63 bytes, so the XOR of
+// all 64 is zero exactly when it is intact: eight 64-bit XORs and a fold per
+// entry instead of 63 byte steps. Returns the first used entry of the block
+// that fails, or -1.
+static long dirent_block_check(const uint8_t* blk){
+    for (size_t e=0;e<BS/64;e++){
+        const uint8_t* d = blk + e*64;
+        uint64_t w[8];
+        memcpy(w, d, sizeof(w));
+        uint32_t ino;
+        memcpy(&ino, d, sizeof(ino));
+        if (!ino) continue;
+        uint64_t x = w[0]^w[1]^w[2]^w[3]^w[4]^w[5]^w[6]^w[7];
+        x ^= x >> 32; x ^= x >> 16; x ^= x >> 8;
+        if ((uint8_t)x) return (long)e;
+    }
+    return -1;
+}
+
+// ================= Merkle tree =================
+// Same layout as mkfs_builder: heap-ordered CRC32 nodes at MERKLE_OFFSET in
+// block 0, leaf i covering blocks [i*64, (i+1)*64) with block 0 skipped.
+// Only the leaves of groups holding a dirty block are rehashed, then the
+// path from each of them to the root.
+static uint32_t merkle_leaf(const uint8_t* img, uint64_t total_blocks, uint32_t leaf){
+    uint32_t blk_crc[MERKLE_GROUP_BLOCKS];
+    uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+    if (first >= total_blocks) return 0;
+    uint64_t n = total_blocks - first;
+    if (n > MERKLE_GROUP_BLOCKS) n = MERKLE_GROUP_BLOCKS;
+    for (uint64_t i=0;i<n;i++)
+        blk_crc[i] = (first+i == 0) ? 0 : crc32_finalize(img + (size_t)(first+i)*BS, BS);
+    return crc32_finalize(blk_crc, (size_t)n * sizeof(uint32_t));
+}
+
+static void merkle_update(uint8_t* img, uint64_t total_blocks, const uint8_t* dirty){
+    uint32_t* tree = (uint32_t*)(img + MERKLE_OFFSET);
+    for (uint32_t leaf=0; leaf<MERKLE_LEAVES; leaf++){
+        uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+        int touched = 0;
+        for (uint64_t b=first; b<first+MERKLE_GROUP_BLOCKS && b<total_blocks; b++)
+            if (bitmap_test(dirty, (size_t)b)){ touched = 1; break; }
+        if (!touched) continue;
+        size_t n = MERKLE_LEAVES-1+leaf;
+        tree[n] = merkle_leaf(img, total_blocks, leaf);
+        while (n){
+            n = (n-1)/2;
+            tree[n] = crc32_finalize(&tree[2*n+1], 2*sizeof(uint32_t));
+        }
+    }
+}
+
+// ================= Image =================
+typedef struct {
+    int           fd;         // O_RDWR unless atime is never written
+    uint8_t*      img;        // whole image, mapped copy-on-write
+    size_t        size;
+    superblock_t* sb;
+    uint8_t*      inode_bm;
+    inode_t*      itab;
+    dirent64_t*   dent;
+    uint8_t       dirty[BS];  // image blocks to write at the next commit
+    int           verify;
+    uint8_t       verified[BS]; // one bit per metadata block checked so far
+    uint32_t      pins;       // read_spans() results still in use
+} image_t;
+
+// ================= Verification =================
+// Same checks as mkfs_adder (see there).
+static int superblock_ok(const superblock_t* sb){
+    superblock_t tmp = *sb;
+    tmp.checksum = 0;
+    return crc32_finalize(&tmp, sizeof(tmp)) == sb->checksum;
+}
+
+// Whether the root inode still carries mkfs_builder's 120-byte CRC, i.e.
+// nothing has written the image since it was built (see mkfs_adder)
+static int root_from_builder(const inode_t* root){
+    uint32_t c120, c128;
+    inode_crc_lanes(&root, 1, &c120, &c128);
+    return root->inode_crc == c120 && root->inode_crc != c128;
+}
+
+// Bad superblock checksum: accepted with a warning on an image unchanged
+// since mkfs_builder (see mkfs_adder). Returns 0 to go on, 2 to reject.
+static int superblock_mismatch(const inode_t* root){
+    if (root_from_builder(root)){
+        fprintf(stderr,"warning: superblock checksum mismatch; accepting an image unchanged since mkfs_builder "
+                       "(older builders stored a bad checksum)\n");
+        return 0;
+    }
+    fprintf(stderr,"superblock checksum mismatch (--no-verify skips the checks)\n");
+    return 2;
+}
+
+// Returns 0 if block `blk` (inode table or directory) checks out, 2 if not
+static int image_verify_block(image_t* im, uint64_t blk){
+    if (!im->verify || bitmap_test(im->verified, (size_t)blk)) return 0;
+    const superblock_t* sb = im->sb;
+    if (blk >= sb->inode_table_start && blk < sb->inode_table_start + sb->inode_table_blocks){
+        uint64_t first = (blk - sb->inode_table_start) * (BS / INODE_SIZE);
+        uint64_t end = first + BS/INODE_SIZE < sb->inode_count ? first + BS/INODE_SIZE : sb->inode_count;
+        for (uint64_t i=first; i<end; ){
+            // Next CRC_LANES allocated inodes of the block
+            const inode_t* lane[CRC_LANES];
+            uint64_t idx[CRC_LANES];
+            size_t n = 0;
+            for (; i<end && n<CRC_LANES; i++)
+                if (bitmap_test(im->inode_bm, (size_t)i)){ idx[n] = i; lane[n++] = &im->itab[i]; }
+            if (!n) break;
+            uint32_t c120[CRC_LANES], c128[CRC_LANES];
+            inode_crc_lanes(lane, n, c120, c128);
+            for (size_t l=0;l<n;l++){
+                if (lane[l]->inode_crc != c128[l] && lane[l]->inode_crc != c120[l]){
+                    fprintf(stderr,"inode #%llu checksum mismatch\n", (unsigned long long)idx[l]+1);
+                    return 2;
+                }
+            }
+        }
+    } else {
+        long bad = dirent_block_check(im->img + (size_t)blk * BS);
+        if (bad >= 0){
+            fprintf(stderr,"directory entry %ld in block %llu checksum mismatch\n", bad, (unsigned long long)blk);
+            return 2;
+        }
+    }
+    bitmap_set(im->verified, (size_t)blk);
+    return 0;
+}
+
+// Checked pointer to inode `ino` (1-based), NULL if it fails verification
+static inode_t* image_inode(image_t* im, uint32_t ino){
+    uint64_t blk = im->sb->inode_table_start + (ino-1) / (BS / INODE_SIZE);
+    return image_verify_block(im, blk) == 0 ? &im->itab[ino-1] : NULL;
+}
+
+// Returns 0 on success, 1 on I/O error, 2 if the file is not a usable image
+static int image_open(image_t* im, const char* path, int writable, int verify){
+    im->verify = verify;
+    im->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (im->fd < 0){ perror("open image"); return 1; }
+    struct stat st;
+    if (fstat(im->fd, &st) != 0){ perror("stat image"); return 1; }
+    if (st.st_size < (off_t)BS){ fprintf(stderr,"not a MiniVSFS image\n"); return 2; }
+    im->size = (size_t)st.st_size;
+    void* m = mmap(NULL, im->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, im->fd, 0);
+    if (m == MAP_FAILED){ perror("map image"); im->size = 0; return 1; }
+    im->img = m;
+
+    superblock_t* sb = im->sb = (superblock_t*)im->img;
+    if (sb->block_size != BS || sb->magic != 0x4D565346u || sb->total_blocks > (uint64_t)BS*8 ||
+        (uint64_t)im->size < sb->total_blocks * BS ||
+        sb->inode_table_blocks * (BS / INODE_SIZE) < sb->inode_count ||
+        sb->inode_table_start + sb->inode_table_blocks > sb->total_blocks){
+        fprintf(stderr,"not a MiniVSFS image\n");
+        return 2;
+    }
+    // Decided once the rest of the metadata has checked out
+    int sb_bad = verify && !superblock_ok(sb);
+    if ((sb->flags & SB_FLAG_MERKLE) && sb->total_blocks > (uint64_t)MERKLE_LEAVES*MERKLE_GROUP_BLOCKS){
+        fprintf(stderr,"image too large for its merkle tree\n");
+        return 2;
+    }
+    im->inode_bm = im->img + (size_t)sb->inode_bitmap_start * BS;
+    im->itab     = (inode_t*)(im->img + (size_t)sb->inode_table_start * BS);
+    const inode_t* root = image_inode(im, ROOT_INO);
+    if (!root) return 2;
+    uint32_t dir_block = root->direct[0];
+    if (dir_block < sb->data_region_start || dir_block >= sb->total_blocks){
+        fprintf(stderr,"root missing first data block\n");
+        return 2;
+    }
+    if (image_verify_block(im, dir_block) != 0) return 2;
+    if (sb_bad && superblock_mismatch(root) != 0) return 2;
+    im->dent = (dirent64_t*)(im->img + (size_t)dir_block * BS);
+    return 0;
+}
+
+static void image_close(image_t* im){
+    if (im->img) munmap(im->img, im->size);
+    if (im->fd >= 0) close(im->fd);
+}
+
+#define IO_GAP_BLOCKS 4u   // clean blocks worth rewriting to save a syscall
+
+static int pwrite_all(int fd, const uint8_t* p, size_t n, off_t off){
+    while (n){
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0){ if (errno == EINTR) continue; return -1; }
+        p += w; n -= (size_t)w; off += w;
+    }
+    return 0;
+}
+
+static int block_is_zero(const uint8_t* p, size_t n){
+    return n == 0 || (p[0] == 0 && memcmp(p, p+1, n-1) == 0);
+}
+
+// Write only the dirty blocks back to an image file that already holds the
+// rest. Dirty blocks are taken in block order and merged into runs, also
+// bridging gaps of up to IO_GAP_BLOCKS clean blocks, but not all-zero ones,
+// which may be holes (see mkfs_adder); each run is one
+// contiguous slice of the in-memory image, so it takes a single pwrite.
+// Block 0 (superblock, checkpoint, merkle root) goes last, after the other
+// runs are synced, so it never describes blocks that are not on disk yet.
+static int image_flush(const image_t* im, int fd){
+    uint64_t total = im->sb->total_blocks;
+    for (uint64_t b=1;b<total;){
+        if (!bitmap_test(im->dirty, (size_t)b)){ b++; continue; }
+        uint64_t e = b+1;   // run is [b, e)
+        for (uint64_t n=e; n<total && n<=e+IO_GAP_BLOCKS; n++){
+            if (bitmap_test(im->dirty, (size_t)n)) e = n+1;
+            else if (block_is_zero(im->img + (size_t)n*BS, BS)) break;
+        }
+        if (pwrite_all(fd, im->img + (size_t)b*BS, (size_t)(e-b)*BS, (off_t)(b*BS)) != 0){ perror("write output"); return 1; }
+        b = e;
+    }
+    if (fdatasync(fd) != 0){ perror("sync output"); return 1; }
+    if (pwrite_all(fd, im->img, BS, 0) != 0 || fdatasync(fd) != 0){ perror("write superblock"); return 1; }
+    return 0;
+}
+
+
+static int image_is_dirty(const image_t* im){
+    for (size_t i=0;i<sizeof(im->dirty);i++) if (im->dirty[i]) return 1;
+    return 0;
+}
+
+// Write back the inode blocks dirtied by atime updates: merkle tree and
+// superblock CRC first, then the blocks, then block 0
+static int image_commit(image_t* im){
+    superblock_t* sb = im->sb;
+    if (sb->flags & SB_FLAG_MERKLE) merkle_update(im->img, sb->total_blocks, im->dirty);
+    superblock_crc_finalize(sb);
+    int rc = image_flush(im, im->fd);
+    memset(im->dirty, 0, sizeof(im->dirty));
+    return rc;
+}
+
+// ================= Atime =================
+typedef enum { ATIME_NOATIME, ATIME_RELATIME, ATIME_STRICT } atime_policy_t;
+
+#define RELATIME_MAX_AGE (24*60*60)
+
+// Apply the policy to one read of `ino`, updating the inode table and the
+// cached copy `cached`; returns 1 if the inode changed
+static int atime_touch(image_t* im, atime_policy_t policy, uint32_t ino, inode_t* cached, time_t now){
+    inode_t* in = &im->itab[ino-1];
+    uint64_t t = (uint64_t)now;
+    if (policy == ATIME_NOATIME || in->atime == t) return 0;
+    if (policy == ATIME_RELATIME && in->atime > in->mtime && in->atime > in->ctime &&
+        in->atime + RELATIME_MAX_AGE > t) return 0;
+    in->atime = t;
+    inode_crc_finalize(in);
+    *cached = *in;
+    bitmap_set(im->dirty, (size_t)(im->sb->inode_table_start + (uint64_t)(ino-1) * INODE_SIZE / BS));
+    return 1;
+}
+
+// ================= Caches =================
+// Lookups are served from two small caches so that names read again and
+// again never touch the directory block or re-check inode records:
+//   dentry cache  (parent inode, name) -> inode, or a negative entry for a
+//                 name that does not exist;
+//   inode cache   decoded, verified copies of inodes, with a reference
+//                 count; entries in use are never evicted.
+// Both have a fixed number of entries, chained hash buckets and an LRU list
+// (indices, no allocation after startup). The image can change under a
+// long-running reader (mkfs_adder, mkfs_sync); every lookup first checks
+// the image file's identity and mtime, and on any change both caches are
+// emptied and the image is mapped again.
+#define DCACHE_MAX     128
+#define DCACHE_BUCKETS 256     // power of two
+#define ICACHE_MAX     64
+#define ICACHE_BUCKETS 128     // power of two
+
+typedef struct { int32_t prev, next; } lru_link_t;
+typedef struct { int32_t head, tail; } lru_t;      // head = most recently used
+
+static void lru_unlink(lru_t* l, lru_link_t* k, int32_t i){
+    if (k[i].prev >= 0) k[k[i].prev].next = k[i].next; else l->head = k[i].next;
+    if (k[i].next >= 0) k[k[i].next].prev = k[i].prev; else l->tail = k[i].prev;
+}
+static void lru_push(lru_t* l, lru_link_t* k, int32_t i){
+    k[i].prev = -1;
+    k[i].next = l->head;
+    if (l->head >= 0) k[l->head].prev = i; else l->tail = i;
+    l->head = i;
+}
+
+// Remove entry i from the chain starting at *head
+static void chain_remove(int32_t* head, int32_t* chain, int32_t i){
+    while (*head != i) head = &chain[*head];
+    *head = chain[i];
+}
+
+typedef struct {
+    uint32_t   parent[DCACHE_MAX];
+    uint32_t   hash[DCACHE_MAX];
+    uint32_t   ino[DCACHE_MAX];    // 0: negative entry
+    char       name[DCACHE_MAX][58];
+    int32_t    chain[DCACHE_MAX];
+    lru_link_t link[DCACHE_MAX];
+    int32_t    bucket[DCACHE_BUCKETS];
+    lru_t      lru;
+    int32_t    n;
+} dcache_t;
+
+typedef struct {
+    uint32_t   ino[ICACHE_MAX];
+    uint32_t   refs[ICACHE_MAX];
+    inode_t    in[ICACHE_MAX];
+    int32_t    chain[ICACHE_MAX];
+    lru_link_t link[ICACHE_MAX];
+    int32_t    bucket[ICACHE_BUCKETS];
+    lru_t      lru;
+    int32_t    n;
+} icache_t;
+
+typedef struct {
+    dcache_t d;
+    icache_t i;
+    uint64_t d_hits, d_neg_hits, d_misses;
+    uint64_t i_hits, i_misses;
+    uint64_t reloads;
+} cache_t;
+
+static void cache_clear(cache_t* c){
+    c->d.n = c->i.n = 0;
+    c->d.lru = c->i.lru = (lru_t){ -1, -1 };
+    memset(c->d.bucket, 0xFF, sizeof(c->d.bucket));
+    memset(c->i.bucket, 0xFF, sizeof(c->i.bucket));
+}
+
+static uint32_t name_hash(uint32_t parent, const char* name){
+    uint32_t h = 2166136261u ^ parent;
+    for (const uint8_t* p=(const uint8_t*)name; *p; p++) h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+// Cached inode number for `name` (0 if known not to exist), or -1 on a miss
+static long long dcache_lookup(cache_t* c, uint32_t parent, const char* name){
+    dcache_t* d = &c->d;
+    uint32_t h = name_hash(parent, name);
+    for (int32_t i=d->bucket[h & (DCACHE_BUCKETS-1)]; i>=0; i=d->chain[i]){
+        if (d->hash[i] != h || d->parent[i] != parent || strncmp(d->name[i], name, sizeof(d->name[i])) != 0) continue;
+        lru_unlink(&d->lru, d->link, i);
+        lru_push(&d->lru, d->link, i);
+        if (d->ino[i]) c->d_hits++; else c->d_neg_hits++;
+        return d->ino[i];
+    }
+    c->d_misses++;
+    return -1;
+}
+
+// `name` must fit dirent64_t.name
+static void dcache_insert(cache_t* c, uint32_t parent, const char* name, uint32_t ino){
+    dcache_t* d = &c->d;
+    int32_t i;
+    if (d->n < DCACHE_MAX){
+        i = d->n++;
+    } else {
+        i = d->lru.tail;
+        lru_unlink(&d->lru, d->link, i);
+        chain_remove(&d->bucket[d->hash[i] & (DCACHE_BUCKETS-1)], d->chain, i);
+    }
+    uint32_t h = name_hash(parent, name);
+    d->parent[i] = parent;
+    d->hash[i] = h;
+    d->ino[i] = ino;
+    size_t len = strnlen(name, sizeof(d->name[i]) - 1);
+    memcpy(d->name[i], name, len);
+    d->name[i][len] = 0;
+    d->chain[i] = d->bucket[h & (DCACHE_BUCKETS-1)];
+    d->bucket[h & (DCACHE_BUCKETS-1)] = i;
+    lru_push(&d->lru, d->link, i);
+}
+
+// Pinned cache entry for inode `ino`, loading (and verifying) it on a miss.
+// Returns -1 if it fails verification, -2 if every entry is pinned.
+static int32_t icache_get(cache_t* c, image_t* im, uint32_t ino){
+    icache_t* x = &c->i;
+    int32_t* b = &x->bucket[ino & (ICACHE_BUCKETS-1)];
+    for (int32_t i=*b; i>=0; i=x->chain[i]){
+        if (x->ino[i] != ino) continue;
+        lru_unlink(&x->lru, x->link, i);
+        lru_push(&x->lru, x->link, i);
+        x->refs[i]++;
+        c->i_hits++;
+        return i;
+    }
+    c->i_misses++;
+    const inode_t* in = image_inode(im, ino);
+    if (!in) return -1;
+    int32_t i;
+    if (x->n < ICACHE_MAX){
+        i = x->n++;
+    } else {
+        for (i=x->lru.tail; i>=0 && x->refs[i]; i=x->link[i].prev) ;
+        if (i < 0){ fprintf(stderr,"inode cache full\n"); return -2; }
+        lru_unlink(&x->lru, x->link, i);
+        chain_remove(&x->bucket[x->ino[i] & (ICACHE_BUCKETS-1)], x->chain, i);
+    }
+    x->ino[i] = ino;
+    x->refs[i] = 1;
+    x->in[i] = *in;
+    x->chain[i] = *b;
+    *b = i;
+    lru_push(&x->lru, x->link, i);
+    return i;
+}
+
+static void icache_put(cache_t* c, int32_t i){
+    c->i.refs[i]--;
+}
+
+// Identity of the image file, to notice writers (in place or by rename)
+typedef struct { dev_t dev; ino_t ino; off_t size; struct timespec mtime; } file_id_t;
+
+static int file_id(const char* path, file_id_t* id){
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    *id = (file_id_t){ st.st_dev, st.st_ino, st.st_size, st.st_mtim };
+    return 0;
+}
+static int file_id_eq(const file_id_t* a, const file_id_t* b){
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+// ================= Reading =================
+typedef struct {
+    uint64_t files, bytes, missing;
+    uint64_t atime_updates, commits;
+    uint64_t atime_drops;     // pending updates dropped for another writer
+} cat_stats_t;
+
+static int dir_find(const image_t* im, const char* name){
+    for (size_t i=0;i<DIR_ENTRIES;i++)
+        if (im->dent[i].inode_no && strncmp(im->dent[i].name, name, sizeof(im->dent[i].name)) == 0) return (int)i;
+    return -1;
+}
+
+// Inode number of `name` in the root directory, 0 if there is none
+static uint32_t lookup_name(image_t* im, cache_t* c, const char* name){
+    if (strlen(name) >= sizeof(im->dent[0].name)) return 0;
+    long long hit = dcache_lookup(c, ROOT_INO, name);
+    if (hit < 0){
+        int slot = dir_find(im, name);
+        hit = slot >= 0 && im->dent[slot].type == 1 ? im->dent[slot].inode_no : 0;
+        dcache_insert(c, ROOT_INO, name, (uint32_t)hit);
+    }
+    return (uint32_t)hit;
+}
+
+// ================= Zero-copy reads =================
+// read_spans() describes bytes [off, off+len) of a file as spans pointing
+// straight into the mapped image, one per run of blocks that are adjacent
+// on disk, so consumers can hash, parse or writev() the contents without a
+// copy. Spans are struct iovec so they go to writev() as they are. They
+// stay valid until spans_unpin(): the pin holds the inode in the cache and
+// keeps the image from being remapped (image_refresh() waits for it).
+#define SPANS_MAX DIRECT_MAX
+
+typedef struct {
+    int32_t entry;      // inode cache entry
+    uint32_t ino;
+} pin_t;
+
+// Returns the number of spans (0 for an empty range), -1 if the inode is
+// corrupt (reported), -2 if the inode cache is full of pinned entries.
+static int read_spans(image_t* im, cache_t* c, uint32_t ino, uint64_t off, uint64_t len,
+                      struct iovec* spans, pin_t* pin){
+    if (ino == 0 || ino > im->sb->inode_count){ fprintf(stderr, "inode #%u out of range\n", ino); return -1; }
+    int32_t e = icache_get(c, im, ino);
+    if (e < 0) return e;
+    const inode_t* in = &c->i.in[e];
+    if (in->size_bytes > (uint64_t)DIRECT_MAX*BS){
+        fprintf(stderr, "inode #%u: size out of range\n", ino);
+        icache_put(c, e);
+        return -1;
+    }
+    if (off > in->size_bytes) off = in->size_bytes;
+    if (len > in->size_bytes - off) len = in->size_bytes - off;
+    int n = 0;
+    for (uint64_t pos=off; pos<off+len; ){
+        uint64_t i = pos / BS;
+        uint32_t b = in->direct[i];
+        if (b < im->sb->data_region_start || b >= im->sb->total_blocks){
+            fprintf(stderr, "inode #%u: block %u out of range\n", ino, b);
+            icache_put(c, e);
+            return -1;
+        }
+        size_t take = (size_t)((i+1)*BS - pos);
+        if (take > off + len - pos) take = (size_t)(off + len - pos);
+        uint8_t* p = im->img + (size_t)b*BS + (size_t)(pos % BS);
+        if (n && (uint8_t*)spans[n-1].iov_base + spans[n-1].iov_len == p) spans[n-1].iov_len += take;
+        else spans[n++] = (struct iovec){ p, take };
+        pos += take;
+    }
+    im->pins++;
+    *pin = (pin_t){ e, ino };
+    return n;
+}
+
+static void spans_unpin(image_t* im, cache_t* c, pin_t pin){
+    icache_put(c, pin.entry);
+    im->pins--;
+}
+
+static int writev_all(int fd, struct iovec* iov, int n){
+    while (n > 0){
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0){ if (errno == EINTR) continue; return -1; }
+        while (n > 0 && (size_t)w >= iov->iov_len){ w -= (ssize_t)iov->iov_len; iov++; n--; }
+        if (n > 0){ iov->iov_base = (uint8_t*)iov->iov_base + w; iov->iov_len -= (size_t)w; }
+    }
+    return 0;
+}
+
+// Send one file to stdout, or with `crc` print its CRC32, straight from the
+// mapping. The pin is left in *pin for the caller to release. Returns 0, 1
+// if the file is not in the image (or the output failed), 2 if its metadata
+// is corrupt.
+static int cat_one(image_t* im, cache_t* c, const char* name, int crc, pin_t* pin){
+    uint32_t ino = lookup_name(im, c, name);
+    if (!ino){
+        fprintf(stderr, "mkfs_cat: '%s': no such file\n", name);
+        return 1;
+    }
+    struct iovec spans[SPANS_MAX];
+    int n = read_spans(im, c, ino, 0, UINT64_MAX, spans, pin);
+    if (n < 0) return 2;
+    if (crc){
+        uint32_t x = 0xFFFFFFFFu;
+        for (int i=0;i<n;i++){
+            const uint8_t* p = spans[i].iov_base;
+            for (size_t k=0;k<spans[i].iov_len;k++) x = CRC32_TAB[(x ^ p[k]) & 0xFFu] ^ (x>>8);
+        }
+        fprintf(stdout, "%08x  %s\n", x ^ 0xFFFFFFFFu, name);
+    } else if (writev_all(STDOUT_FILENO, spans, n) != 0){
+        perror("write");
+        spans_unpin(im, c, *pin);
+        return 1;
+    }
+    return 0;
+}
+
+// ================= Image lock (same as mkfs_adder) =================
+// Exclusive flock() on the image file, shared by every tool that writes it
+// (see mkfs_adder). Returns the lock descriptor, or -1.
+static int image_lock(const char* path){
+    for (;;){
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0){ perror("open image"); return -1; }
+        if (flock(fd, LOCK_EX) != 0){ perror("lock image"); close(fd); return -1; }
+        struct stat a, b;
+        if (fstat(fd, &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) return fd;
+        close(fd);
+    }
+}
+static void image_unlock(int fd){ if (fd >= 0) close(fd); }
+
+// Map the image again after another tool changed it: drop the caches and
+// any lazytime updates not yet written, whose inode blocks are stale copies
+// that would overwrite the writer's. Caller holds the image lock.
+static int image_remap(image_t* im, cache_t* c, const char* path, int writable, cat_stats_t* st){
+    int verify = im->verify;
+    if (image_is_dirty(im)) st->atime_drops++;
+    image_close(im);
+    memset(im, 0, sizeof(*im));
+    im->fd = -1;
+    cache_clear(c);
+    c->reloads++;
+    return image_open(im, path, writable, verify);
+}
+
+// If the image file changed since it was mapped, map it again under the
+// image lock, so not halfway through another writer's commit. Not while
+// spans are pinned.
+static int image_refresh(image_t* im, cache_t* c, const char* path, file_id_t* id, int writable, cat_stats_t* st){
+    if (im->pins) return 0;
+    file_id_t now;
+    if (file_id(path, &now) != 0){ perror("stat image"); return 1; }
+    if (file_id_eq(&now, id)) return 0;
+    int lock_fd = image_lock(path);
+    if (lock_fd < 0) return 1;
+    int rc = 1;
+    if (file_id(path, &now) != 0) perror("stat image");
+    else if ((rc = image_remap(im, c, path, writable, st)) == 0) *id = now;
+    image_unlock(lock_fd);
+    return rc;
+}
+
+// image_commit() under the image lock, then take the new mtime as our own
+// so it does not look like another writer. The identity is checked again
+// once the lock is held: if another tool changed the image since it was
+// mapped, the pending updates are dropped and the image mapped again
+// instead of committing.
+static int commit_tracked(image_t* im, cache_t* c, const char* path, file_id_t* id, cat_stats_t* st){
+    int lock_fd = image_lock(path);
+    if (lock_fd < 0) return 1;
+    file_id_t now;
+    int rc = 1;
+    if (file_id(path, &now) != 0) perror("stat image");
+    else if (!file_id_eq(&now, id)){
+        if ((rc = image_remap(im, c, path, 1, st)) == 0) *id = now;
+    } else if (image_commit(im) == 0){
+        st->commits++;
+        if (file_id(path, id) != 0) perror("stat image");
+        else rc = 0;
+    }
+    image_unlock(lock_fd);
+    return rc;
+}
+
+// ================= Metrics (format as in mkfs_adder) =================
+#define METRICS_EVERY_SECS 10
+
+static void prom_label(FILE* f, const char* s){
+    for (; *s; s++){
+        if (*s == '\\' || *s == '"') fputc('\\', f);
+        if (*s == '\n'){ fputs("\\n", f); continue; }
+        fputc(*s, f);
+    }
+}
+
+static void prom_counter(FILE* f, const char* name, const char* help, const char* image, uint64_t v){
+    fprintf(f, "# HELP minivsfs_cat_%s %s\n# TYPE minivsfs_cat_%s counter\nminivsfs_cat_%s{image=\"", name, help, name, name);
+    prom_label(f, image);
+    fprintf(f, "\"} %" PRIu64 "\n", v);
+}
+
+// Written to <path>.tmp and renamed into place
+static int metrics_write(const char* path, const char* image, const cat_stats_t* st, const cache_t* c){
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (!f){ perror("open metrics"); return 1; }
+    prom_counter(f, "files_total", "Files read.", image, st->files);
+    prom_counter(f, "bytes_total", "File bytes read.", image, st->bytes);
+    prom_counter(f, "missing_total", "Names not found.", image, st->missing);
+    prom_counter(f, "atime_updates_total", "Access time updates.", image, st->atime_updates);
+    prom_counter(f, "commits_total", "Metadata commits.", image, st->commits);
+    prom_counter(f, "atime_drops_total", "Pending atime updates dropped because another tool changed the image.", image, st->atime_drops);
+    prom_counter(f, "dentry_cache_hits_total", "Name lookups served from the dentry cache.", image, c->d_hits);
+    prom_counter(f, "dentry_cache_negative_hits_total", "Lookups answered by a negative dentry.", image, c->d_neg_hits);
+    prom_counter(f, "dentry_cache_misses_total", "Name lookups that scanned the directory.", image, c->d_misses);
+    prom_counter(f, "inode_cache_hits_total", "Inodes served from the inode cache.", image, c->i_hits);
+    prom_counter(f, "inode_cache_misses_total", "Inodes loaded from the inode table.", image, c->i_misses);
+    prom_counter(f, "cache_reloads_total", "Cache flushes after the image changed.", image, c->reloads);
+    int bad = ferror(f);
+    if (fclose(f) != 0 || bad || rename(tmp, path) != 0){
+        perror("write metrics");
+        remove(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+// ================= CLI =================
+static void usage(const char* prog){
+    fprintf(stderr,
+        "Usage: %s --image fs.img [--atime noatime|relatime|strict] [--lazytime [--flush-secs <n>]]\n"
+        "          [--trace <read log>] [--stats] [--metrics <file>] [--crc32]\n"
+        "          [--no-verify] (<name> ... | -)\n", prog);
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    const char* image = NULL;
+    const char* trace_path = NULL;
+    const char* metrics_path = NULL;
+    const char** names = calloc((size_t)argc, sizeof(*names));
+    size_t nnames = 0;
+    atime_policy_t policy = ATIME_RELATIME;
+    int lazytime = 0, stats = 0, from_stdin = 0, crc = 0, verify = 1;
+    long flush_secs = 0;
+    if (!names){ fprintf(stderr,"oom\n"); return 1; }
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--image") && i+1<argc) image = argv[++i];
+        else if (!strcmp(argv[i],"--atime") && i+1<argc){
+            const char* a = argv[++i];
+            if (!strcmp(a,"noatime")) policy = ATIME_NOATIME;
+            else if (!strcmp(a,"relatime")) policy = ATIME_RELATIME;
+            else if (!strcmp(a,"strict")) policy = ATIME_STRICT;
+            else { usage(argv[0]); free(names); return 2; }
+        }
+        else if (!strcmp(argv[i],"--lazytime")) lazytime = 1;
+        else if (!strcmp(argv[i],"--flush-secs") && i+1<argc) flush_secs = strtol(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i],"--trace") && i+1<argc) trace_path = argv[++i];
+        else if (!strcmp(argv[i],"--stats")) stats = 1;
+        else if (!strcmp(argv[i],"--metrics") && i+1<argc) metrics_path = argv[++i];
+        else if (!strcmp(argv[i],"--crc32")) crc = 1;
+        else if (!strcmp(argv[i],"--no-verify")) verify = 0;
+        else if (!strcmp(argv[i],"-")) from_stdin = 1;
+        else if (argv[i][0] != '-') names[nnames++] = argv[i];
+        else { usage(argv[0]); free(names); return 2; }
+    }
+    if (!image || (!nnames && !from_stdin) || (nnames && from_stdin) || flush_secs < 0){
+        usage(argv[0]);
+        free(names);
+        return 2;
+    }
+
+    image_t* im = calloc(1, sizeof(*im));
+    cache_t* c = calloc(1, sizeof(*c));
+    FILE* trace = NULL;
+    cat_stats_t st = {0};
+    file_id_t id;
+    int writable = policy != ATIME_NOATIME;
+    int rc = 1;
+    if (!im || !c){ fprintf(stderr,"oom\n"); goto out; }
+    im->fd = -1;
+    cache_clear(c);
+    if (writable && policy != ATIME_STRICT){
+        int probe = open(image, O_RDWR | O_CLOEXEC);
+        if (probe >= 0) close(probe);
+        else if (errno == EACCES || errno == EROFS || errno == EPERM){
+            fprintf(stderr, "mkfs_cat: '%s' is not writable (%s); not updating atime\n", image, strerror(errno));
+            policy = ATIME_NOATIME;
+            writable = 0;
+        }
+    }
+    int lock_fd = image_lock(image);
+    if (lock_fd < 0) goto out;
+    if (file_id(image, &id) != 0) perror("stat image");
+    else rc = image_open(im, image, writable, verify);
+    image_unlock(lock_fd);
+    if (rc) goto out;
+    rc = 1;
+    if (trace_path && !(trace = fopen(trace_path, "a"))){ perror("open trace"); goto out; }
+
+    time_t last_flush = time(NULL), last_metrics = last_flush;
+    char line[4096];
+    int status = 0;
+    for (size_t k=0; ; k++){
+        const char* name;
+        if (from_stdin){
+            if (!fgets(line, sizeof(line), stdin)) break;
+            line[strcspn(line, "\r\n")] = 0;
+            if (!line[0]) continue;
+            name = line;
+        } else {
+            if (k == nnames) break;
+            name = names[k];
+        }
+        if ((rc = image_refresh(im, c, image, &id, writable, &st)) != 0) goto out;
+        rc = 1;
+        pin_t pin;
+        int r = cat_one(im, c, name, crc, &pin);
+        if (r == 2){ rc = 2; goto out; }
+        if (r){ status = 1; st.missing++; continue; }
+        st.files++;
+        st.bytes += c->i.in[pin.entry].size_bytes;
+        if (trace) fprintf(trace, "%s\n", name);
+
+        time_t now = time(NULL);
+        int touched = atime_touch(im, policy, pin.ino, &c->i.in[pin.entry], now);
+        spans_unpin(im, c, pin);
+        if (touched){
+            st.atime_updates++;
+            if (!lazytime && commit_tracked(im, c, image, &id, &st) != 0) goto out;
+        }
+        if (from_stdin){
+            fflush(stdout);
+            if (lazytime && flush_secs && now - last_flush >= flush_secs){
+                if (image_is_dirty(im) && commit_tracked(im, c, image, &id, &st) != 0) goto out;
+                last_flush = now;
+            }
+            if (metrics_path && now - last_metrics >= METRICS_EVERY_SECS){
+                if (metrics_write(metrics_path, image, &st, c) != 0) goto out;
+                last_metrics = now;
+            }
+        }
+    }
+    // Pending lazytime updates are written back once, at close
+    if (image_is_dirty(im) && commit_tracked(im, c, image, &id, &st) != 0) goto out;
+    if (fflush(stdout) != 0){ perror("write"); goto out; }
+    rc = status;
+
+out:
+    if (stats)
+        fprintf(stderr, "mkfs_cat: %llu file(s), %llu byte(s), %llu missing; %llu atime update(s), %llu metadata commit(s), "
+                        "%llu dropped\n",
+                (unsigned long long)st.files, (unsigned long long)st.bytes, (unsigned long long)st.missing,
+                (unsigned long long)st.atime_updates, (unsigned long long)st.commits,
+                (unsigned long long)st.atime_drops);
+    if (stats && c)
+        fprintf(stderr, "mkfs_cat: dentry cache %llu hit(s), %llu negative hit(s), %llu miss(es); "
+                        "inode cache %llu hit(s), %llu miss(es); %llu reload(s)\n",
+                (unsigned long long)c->d_hits, (unsigned long long)c->d_neg_hits, (unsigned long long)c->d_misses,
+                (unsigned long long)c->i_hits, (unsigned long long)c->i_misses, (unsigned long long)c->reloads);
+    if (metrics_path && c && metrics_write(metrics_path, image, &st, c) != 0 && !rc) rc = 1;
+    if (trace && fclose(trace) != 0){ perror("close trace"); if (!rc) rc = 1; }
+    if (im) image_close(im);
+    free(im);
+    free(c);
+    free(names);
+    return rc;
+}
@@ -0,0 +1,337 @@
+/*
+ Build:
+   gcc -O2 -std=c17 -Wall -Wextra mkfs_chunkstore.c -o mkfs_chunkstore
+
+ Usage:
+   ./mkfs_chunkstore --store fleet.chunks --put fs.img --recipe fs.recipe
+   ./mkfs_chunkstore --store fleet.chunks --get fs.recipe --image fs.img
+
+ Content-addressed chunk store shared by many images. --put cuts an image
+ into variable-size chunks with a gear rolling hash (FastCDC-style, 2..64 KiB,
+ ~8 KiB average), appends the chunks the store does not have yet to
+ <store>, records them in <store>.idx and writes a recipe listing the chunks
+ that make up the image. --get rebuilds the image from its recipe. Since cut
+ points depend on content, not offsets, identical data in different images
+ (or shifted within one) maps to the same chunks and is stored once.
+ Concurrent --put runs on one store are serialized by an exclusive flock()
+ on <store>, held for the whole put.
+*/
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define CDC_MIN    2048u
+#define CDC_AVG    8192u
+#define CDC_MAX    65536u
+#define CDC_MASK_S 0xFFFE000000000000ull  // 15 bits: cuts are rarer before CDC_AVG...
+#define CDC_MASK_L 0xFFE0000000000000ull  // 11 bits: ...and likelier after it
+#define RECIPE_MAGIC 0x5243564Du          // "MVCR"
+
+#pragma pack(push,1)
+typedef struct {
+    uint64_t hash;          // FNV-1a 64 of the chunk bytes
+    uint64_t offset;        // byte offset in the store file
+    uint32_t length;
+} chunk_ref_t;              // one record in <store>.idx and in a recipe
+
+typedef struct {
+    uint32_t magic;         // RECIPE_MAGIC
+    uint32_t version;       // 1
+    uint64_t image_size;
+    uint64_t nchunks;       // chunk_ref_t records that follow
+} recipe_hdr_t;
+#pragma pack(pop)
+
+// ================= Hashing =================
+static uint64_t GEAR[256];
+static void gear_init(void){
+    uint64_t x = 0x9E3779B97F4A7C15ull;   // splitmix64, fixed seed: cut points must be stable
+    for (int i=0;i<256;i++){
+        uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z>>27)) * 0x94D049BB133111EBull;
+        GEAR[i] = z ^ (z>>31);
+    }
+}
+
+// Length of the next chunk of p[0..n)
+static size_t cdc_cut(const uint8_t* p, size_t n){
+    if (n <= CDC_MIN) return n;
+    size_t end = n < CDC_MAX ? n : CDC_MAX;
+    size_t mid = end < CDC_AVG ? end : CDC_AVG;
+    uint64_t h = 0;
+    size_t i = CDC_MIN;
+    for (; i<mid; i++){ h = (h<<1) + GEAR[p[i]]; if (!(h & CDC_MASK_S)) return i+1; }
+    for (; i<end; i++){ h = (h<<1) + GEAR[p[i]]; if (!(h & CDC_MASK_L)) return i+1; }
+    return end;
+}
+
+static uint64_t fnv1a64(const uint8_t* p, size_t n){
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t i=0;i<n;i++){ h ^= p[i]; h *= 0x100000001B3ull; }
+    return h;
+}
+
+// ================= Chunk index =================
+// All records of <store>.idx, plus an open-addressing table on the hash
+typedef struct {
+    chunk_ref_t* refs;
+    size_t       n, cap;
+    uint32_t*    slots;     // index+1 into refs, 0 = empty
+    size_t       nslots;    // power of two, kept at least 2*n
+} chunk_index_t;
+
+static int index_rehash(chunk_index_t* x, size_t nslots){
+    uint32_t* slots = calloc(nslots, sizeof(uint32_t));
+    if (!slots) return 1;
+    for (size_t i=0;i<x->n;i++){
+        size_t s = (size_t)x->refs[i].hash & (nslots-1);
+        while (slots[s]) s = (s+1) & (nslots-1);
+        slots[s] = (uint32_t)(i+1);
+    }
+    free(x->slots);
+    x->slots = slots;
+    x->nslots = nslots;
+    return 0;
+}
+
+static int index_add(chunk_index_t* x, chunk_ref_t r){
+    if (x->n == x->cap){
+        size_t cap = x->cap ? x->cap*2 : 1024;
+        chunk_ref_t* refs = realloc(x->refs, cap * sizeof(*refs));
+        if (!refs) return 1;
+        x->refs = refs;
+        x->cap = cap;
+    }
+    x->refs[x->n++] = r;
+    if (2*x->n > x->nslots) return index_rehash(x, x->nslots ? x->nslots*2 : 2048);
+    size_t s = (size_t)r.hash & (x->nslots-1);
+    while (x->slots[s]) s = (s+1) & (x->nslots-1);
+    x->slots[s] = (uint32_t)x->n;
+    return 0;
+}
+
+// Calls `match` on every record with this hash until it returns nonzero
+static const chunk_ref_t* index_find(const chunk_index_t* x, uint64_t hash,
+                                     int (*match)(const chunk_ref_t*, void*), void* arg){
+    if (!x->nslots) return NULL;
+    for (size_t s = (size_t)hash & (x->nslots-1); x->slots[s]; s = (s+1) & (x->nslots-1)){
+        const chunk_ref_t* r = &x->refs[x->slots[s]-1];
+        if (r->hash == hash && match(r, arg)) return r;
+    }
+    return NULL;
+}
+
+static int index_load(chunk_index_t* x, const char* path){
+    FILE* f = fopen(path, "rb");
+    if (!f) return errno == ENOENT ? 0 : (perror("open index"), 1);
+    chunk_ref_t r;
+    while (fread(&r, sizeof(r), 1, f) == 1){
+        if (index_add(x, r) != 0){ fprintf(stderr,"oom\n"); fclose(f); return 1; }
+    }
+    int bad = ferror(f);
+    fclose(f);
+    if (bad){ perror("read index"); return 1; }
+    return 0;
+}
+
+// ================= Files =================
+// --put reads the image exactly once, front to back: map it read-only with
+// sequential readahead, and once chunked drop both the mapping's pages and
+// the file's page cache, so exporting a fleet of images does not evict
+// everything else from memory.
+static int map_image(const char* path, uint8_t** out, size_t* out_size){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){ perror("open"); return 1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0){ perror("stat"); close(fd); return 1; }
+    if (st.st_size == 0){ close(fd); *out = NULL; *out_size = 0; return 0; }
+    void* m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED){ perror("map"); return 1; }
+    madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+    madvise(m, (size_t)st.st_size, MADV_WILLNEED);
+    *out = m;
+    *out_size = (size_t)st.st_size;
+    return 0;
+}
+
+static void unmap_image(const char* path, uint8_t* img, size_t size){
+    if (!img) return;
+    madvise(img, size, MADV_DONTNEED);
+    munmap(img, size);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0){ posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); close(fd); }
+}
+
+typedef struct {
+    FILE*          store;
+    const uint8_t* data;
+    uint8_t*       scratch;   // CDC_MAX bytes
+} match_ctx_t;
+
+// Hash hits are confirmed against the stored bytes
+static int chunk_matches(const chunk_ref_t* r, void* arg){
+    match_ctx_t* m = arg;
+    return fseeko(m->store, (off_t)r->offset, SEEK_SET) == 0 &&
+           fread(m->scratch, 1, r->length, m->store) == r->length &&
+           memcmp(m->scratch, m->data, r->length) == 0;
+}
+
+static int do_put(const char* store_path, const char* idx_path, const char* image, const char* recipe){
+    chunk_index_t x = {0};
+    uint8_t* img = NULL;
+    size_t isz = 0;
+    chunk_ref_t* refs = NULL;
+    FILE *fs = NULL, *fx = NULL, *fr = NULL;
+    uint8_t* scratch = malloc(CDC_MAX);
+    int rc = 1;
+    if (!scratch){ fprintf(stderr,"oom\n"); goto out; }
+    if (map_image(image, &img, &isz) != 0) goto out;
+    refs = malloc((isz / CDC_MIN + 1) * sizeof(*refs));
+    if (!refs){ fprintf(stderr,"oom\n"); goto out; }
+
+    // Other puts append to the same store and index: the index is loaded and
+    // every offset taken under the lock, which fclose() releases
+    fs = fopen(store_path, "a+b");
+    if (!fs){ perror("open store"); goto out; }
+    if (flock(fileno(fs), LOCK_EX) != 0){ perror("lock store"); goto out; }
+    if (index_load(&x, idx_path) != 0) goto out;
+    fx = fopen(idx_path, "ab");
+    if (!fx){ perror("open index"); goto out; }
+    posix_fadvise(fileno(fs), 0, 0, POSIX_FADV_RANDOM);   // hit checks jump around
+
+    size_t nrefs = 0, new_chunks = 0;
+    uint64_t new_bytes = 0;
+    for (size_t off=0; off<isz; ){
+        size_t len = cdc_cut(img + off, isz - off);
+        uint64_t h = fnv1a64(img + off, len);
+        match_ctx_t m = { fs, img + off, scratch };
+        const chunk_ref_t* hit = index_find(&x, h, chunk_matches, &m);
+        if (hit){
+            refs[nrefs++] = *hit;
+        } else {
+            off_t at;
+            if (fseeko(fs, 0, SEEK_END) != 0 || (at = ftello(fs)) < 0){ perror("seek store"); goto out; }
+            chunk_ref_t r = { h, (uint64_t)at, (uint32_t)len };
+            if (fwrite(img + off, 1, len, fs) != len){ perror("write store"); goto out; }
+            if (fwrite(&r, sizeof(r), 1, fx) != 1){ perror("write index"); goto out; }
+            if (index_add(&x, r) != 0){ fprintf(stderr,"oom\n"); goto out; }
+            refs[nrefs++] = r;
+            new_chunks++;
+            new_bytes += len;
+        }
+        off += len;
+    }
+    // Chunks must be durable before a recipe can refer to them
+    if (fflush(fs) != 0 || fsync(fileno(fs)) != 0 || fflush(fx) != 0 || fsync(fileno(fx)) != 0){
+        perror("sync store");
+        goto out;
+    }
+
+    fr = fopen(recipe, "wb");
+    if (!fr){ perror("open recipe"); goto out; }
+    recipe_hdr_t hdr = { RECIPE_MAGIC, 1, (uint64_t)isz, (uint64_t)nrefs };
+    if (fwrite(&hdr, sizeof(hdr), 1, fr) != 1 ||
+        fwrite(refs, sizeof(*refs), nrefs, fr) != nrefs){ perror("write recipe"); goto out; }
+    if (fclose(fr) != 0){ fr = NULL; perror("close recipe"); goto out; }
+    fr = NULL;
+
+    fprintf(stdout, "Stored '%s' as %zu chunk(s), %zu new (%llu of %zu bytes written) -> '%s'\n",
+            image, nrefs, new_chunks, (unsigned long long)new_bytes, isz, recipe);
+    rc = 0;
+
+out:
+    if (fr) fclose(fr);
+    if (fx) fclose(fx);
+    if (fs) fclose(fs);
+    free(refs);
+    unmap_image(image, img, isz);
+    free(scratch);
+    free(x.refs);
+    free(x.slots);
+    return rc;
+}
+
+static int do_get(const char* store_path, const char* recipe, const char* image){
+    FILE* fr = fopen(recipe, "rb");
+    if (!fr){ perror("open recipe"); return 1; }
+    recipe_hdr_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fr) != 1 || hdr.magic != RECIPE_MAGIC || hdr.version != 1){
+        fprintf(stderr,"not a chunk recipe\n");
+        fclose(fr);
+        return 2;
+    }
+    FILE* fs = fopen(store_path, "rb");
+    if (!fs){ perror("open store"); fclose(fr); return 1; }
+    posix_fadvise(fileno(fs), 0, 0, POSIX_FADV_RANDOM);   // chunks are shared, so scattered
+    FILE* fo = fopen(image, "wb");
+    if (!fo){ perror("open image"); fclose(fs); fclose(fr); return 1; }
+
+    uint8_t* buf = malloc(CDC_MAX);
+    uint64_t total = 0;
+    int rc = 1;
+    if (!buf){ fprintf(stderr,"oom\n"); goto out; }
+    for (uint64_t i=0;i<hdr.nchunks;i++){
+        chunk_ref_t r;
+        if (fread(&r, sizeof(r), 1, fr) != 1){ fprintf(stderr,"recipe truncated\n"); goto out; }
+        if (r.length > CDC_MAX || fseeko(fs, (off_t)r.offset, SEEK_SET) != 0 ||
+            fread(buf, 1, r.length, fs) != r.length){ fprintf(stderr,"chunk %llu missing from store\n", (unsigned long long)i); goto out; }
+        if (fnv1a64(buf, r.length) != r.hash){ fprintf(stderr,"chunk %llu corrupt in store\n", (unsigned long long)i); goto out; }
+        if (fwrite(buf, 1, r.length, fo) != r.length){ perror("write image"); goto out; }
+        total += r.length;
+    }
+    if (total != hdr.image_size){ fprintf(stderr,"recipe size mismatch\n"); goto out; }
+    rc = 0;
+    fprintf(stdout, "Restored '%s' (%llu bytes, %llu chunk(s)) from '%s'\n",
+            image, (unsigned long long)total, (unsigned long long)hdr.nchunks, store_path);
+
+out:
+    free(buf);
+    if (fclose(fo) != 0 && rc == 0){ perror("close image"); rc = 1; }
+    fclose(fs);
+    fclose(fr);
+    return rc;
+}
+
+// ================= CLI =================
+static void usage(const char* prog){
+    fprintf(stderr,
+        "Usage: %s --store <file> --put <image> --recipe <out>\n"
+        "       %s --store <file> --get <recipe> --image <out>\n", prog, prog);
+}
+
+int main(int argc, char** argv){
+    gear_init();
+    const char *store=NULL, *put=NULL, *get=NULL, *recipe=NULL, *image=NULL;
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--store") && i+1<argc) store = argv[++i];
+        else if (!strcmp(argv[i],"--put") && i+1<argc) put = argv[++i];
+        else if (!strcmp(argv[i],"--get") && i+1<argc) get = argv[++i];
+        else if (!strcmp(argv[i],"--recipe") && i+1<argc) recipe = argv[++i];
+        else if (!strcmp(argv[i],"--image") && i+1<argc) image = argv[++i];
+        else { usage(argv[0]); return 2; }
+    }
+    if (!store || !!put == !!get || (put && !recipe) || (get && !image)){ usage(argv[0]); return 2; }
+
+    if (get) return do_get(store, get, image);
+
+    size_t n = strlen(store);
+    char* idx = malloc(n + 5);
+    if (!idx){ fprintf(stderr,"oom\n"); return 1; }
+    memcpy(idx, store, n);
+    memcpy(idx + n, ".idx", 5);
+    int rc = do_put(store, idx, put, recipe);
+    free(idx);
+    return rc;
+}
@@ -0,0 +1,489 @@
+/*
+ Build:
+   gcc -O2 -std=c17 -Wall -Wextra mkfs_relayout.c -o mkfs_relayout
+
+ Usage:
+   ./mkfs_relayout --image fs.img [--trace reads.log ...] [--background]
+
+ Reorders the data region by how often files are read. Read counts live in
+ an access map next to the image, <image>.heat ("<count> <name>" per line,
+ hottest first). Each --trace is a replayed read log, one file name per
+ read (mkfs_cat --trace writes one), and its counts are added to the map.
+ Files are then laid out front to back: the root directory block, files
+ that have been read (most reads first; equal counts keep the order they
+ were first read in, so files read together stay together), then the rest
+ in their current order. The hot working set ends up as one contiguous run
+ at the start of the data region, where readahead covers it.
+
+ Inode numbers, names and contents do not change, only block addresses.
+ The new image is written to <image>.tmp and renamed over the original; the
+ access map is rewritten after it. Both happen under the exclusive flock()
+ every image writer takes (see mkfs_adder). --background lowers the I/O priority
+ of the rewrite below that of readers (see mkfs_adder).
+*/
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+
+#define SB_FLAG_MERKLE      0x1u    // superblock_t.flags: hash tree present
+#define MERKLE_GROUP_BLOCKS 64u     // blocks hashed into one leaf
+#define MERKLE_LEAVES       16u     // 4096 KiB max image / 64 blocks per leaf
+#define MERKLE_OFFSET       2048u   // byte offset of the node array in block 0
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;        // 1=file, 2=dir
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+#pragma pack(pop)
+
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+#define DIR_ENTRIES (BS / sizeof(dirent64_t))
+
+// ================= CRC32 (same definitions as mkfs_adder) =================
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for (int j=0;j<8;j++){
+            c = (c&1)? (0xEDB88320u ^ (c>>1)) : (c>>1);
+        }
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32_finalize(const void*buf, size_t len){
+    const uint8_t* p=(const uint8_t*)buf;
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i=0;i<len;i++) c = CRC32_TAB[(c ^ p[i]) & 0xFFu] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+static void superblock_crc_finalize(superblock_t* sb){
+    sb->checksum = 0;
+    sb->checksum = crc32_finalize(sb, sizeof(*sb));
+}
+static void inode_crc_finalize(inode_t* in){
+    in->inode_crc = 0;
+    in->inode_crc = (uint64_t)crc32_finalize(in, sizeof(*in));
+}
+
+// ================= Bitmap helpers =================
+static inline void bitmap_set(uint8_t* bm, size_t idx){ bm[idx>>3] |= (uint8_t)(1u << (idx & 7u)); }
+static inline int  bitmap_test(const uint8_t* bm, size_t idx){ return (bm[idx>>3] >> (idx & 7u)) & 1u; }
+
+// ================= Merkle tree (layout: see mkfs_builder) =================
+static void merkle_rebuild(uint8_t* img, uint64_t total_blocks){
+    uint32_t* tree = (uint32_t*)(img + MERKLE_OFFSET);
+    for (uint32_t leaf=0; leaf<MERKLE_LEAVES; leaf++){
+        uint32_t blk_crc[MERKLE_GROUP_BLOCKS];
+        uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+        if (first >= total_blocks){ tree[MERKLE_LEAVES-1+leaf] = 0; continue; }
+        uint64_t n = total_blocks - first;
+        if (n > MERKLE_GROUP_BLOCKS) n = MERKLE_GROUP_BLOCKS;
+        for (uint64_t i=0;i<n;i++)
+            blk_crc[i] = (first+i == 0) ? 0 : crc32_finalize(img + (size_t)(first+i)*BS, BS);
+        tree[MERKLE_LEAVES-1+leaf] = crc32_finalize(blk_crc, (size_t)n * sizeof(uint32_t));
+    }
+    for (long n=(long)MERKLE_LEAVES-2; n>=0; n--)
+        tree[n] = crc32_finalize(&tree[2*n+1], 2*sizeof(uint32_t));
+}
+
+// ================= Access map =================
+// Read counts per directory slot. `first` orders files with equal counts:
+// map lines come before trace lines, in file order, so the previous layout
+// is kept unless new reads say otherwise.
+typedef struct {
+    uint64_t count[DIR_ENTRIES];
+    uint64_t first[DIR_ENTRIES];
+    uint64_t seq;               // lines seen so far, across all inputs
+    uint64_t reads;             // reads matched to a file in the image
+} heat_t;
+
+static int dir_find(const dirent64_t* dent, const char* name){
+    for (size_t i=0;i<DIR_ENTRIES;i++)
+        if (dent[i].inode_no && dent[i].type == 1 && strncmp(dent[i].name, name, sizeof(dent[i].name)) == 0) return (int)i;
+    return -1;
+}
+
+// Add the counts in `path`: "<count> <name>" lines (access map) or bare
+// names (trace, one read each). A missing access map is an empty one.
+static int heat_add(heat_t* h, const dirent64_t* dent, const char* path, int is_map){
+    FILE* f = fopen(path, "r");
+    if (!f){
+        if (is_map && errno == ENOENT) return 0;
+        perror(path);
+        return 1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)){
+        line[strcspn(line, "\r\n")] = 0;
+        uint64_t n = 1;
+        const char* name = line;
+        if (is_map){
+            char* end;
+            n = strtoull(line, &end, 10);
+            if (end == line || *end != ' '){ fprintf(stderr,"%s: bad line '%s'\n", path, line); fclose(f); return 2; }
+            name = end + 1;
+        } else {
+            const char* base = strrchr(line, '/');
+            if (base) name = base + 1;
+        }
+        h->seq++;
+        int slot = *name ? dir_find(dent, name) : -1;
+        if (slot < 0 || !n) continue;
+        if (!h->count[slot]) h->first[slot] = h->seq;
+        h->count[slot] += n;
+        h->reads += n;
+    }
+    int rc = ferror(f) ? 1 : 0;
+    if (rc) perror(path);
+    fclose(f);
+    return rc;
+}
+
+// Hottest first, ties by first read; `heat` entries carry the first
+// directory slot of each inode
+typedef struct {
+    uint32_t ino;
+    uint64_t count, first;
+    uint32_t first_blk;         // current first data block, for cold files
+} file_t;
+
+static int file_cmp(const void* a, const void* b){
+    const file_t* x = a;
+    const file_t* y = b;
+    if ((x->count > 0) != (y->count > 0)) return x->count > 0 ? -1 : 1;
+    if (x->count){
+        if (x->count != y->count) return x->count > y->count ? -1 : 1;
+        if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    } else if (x->first_blk != y->first_blk){
+        return x->first_blk < y->first_blk ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : (x->ino > y->ino);
+}
+
+static int heat_write(const char* path, const heat_t* h, const dirent64_t* dent, const file_t* files, size_t nfiles){
+    size_t plen = strlen(path);
+    char* tmp = malloc(plen + 5);
+    if (!tmp){ fprintf(stderr,"oom\n"); return 1; }
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+    FILE* f = fopen(tmp, "w");
+    if (!f){ perror("open access map"); free(tmp); return 1; }
+    // Names in layout order, so the next run keeps ties where they are
+    for (size_t k=0;k<nfiles && files[k].count;k++)
+        for (size_t i=0;i<DIR_ENTRIES;i++)
+            if (dent[i].inode_no == files[k].ino && h->count[i])
+                fprintf(f, "%llu %.*s\n", (unsigned long long)h->count[i], (int)sizeof(dent[i].name), dent[i].name);
+    int rc = 0;
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0){ perror("write access map"); rc = 1; }
+    if (fclose(f) != 0 && !rc){ perror("close access map"); rc = 1; }
+    if (!rc && rename(tmp, path) != 0){ perror("rename access map"); rc = 1; }
+    if (rc) remove(tmp);
+    free(tmp);
+    return rc;
+}
+
+// ================= Image =================
+static int block_is_zero(const uint8_t* p, size_t n){
+    return n == 0 || (p[0] == 0 && memcmp(p, p+1, n-1) == 0);
+}
+
+// Same scheme as mkfs_adder: <path>.tmp, zero blocks left as holes, synced,
+// renamed over <path>
+static int image_write(const uint8_t* img, size_t size, const char* path){
+    size_t plen = strlen(path);
+    char* tmp = malloc(plen + 5);
+    if (!tmp){ fprintf(stderr,"oom\n"); return 1; }
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+    FILE* fo = fopen(tmp, "wb");
+    if (!fo){ perror("open output"); free(tmp); return 1; }
+    for (size_t off=0; off<size; off+=BS){
+        size_t n = size - off < BS ? size - off : BS;
+        if (block_is_zero(img + off, n)){
+            if (fseeko(fo, (off_t)n, SEEK_CUR) != 0){ perror("seek output"); goto fail; }
+        } else if (fwrite(img + off,1,n,fo)!=n){ perror("write output"); goto fail; }
+    }
+    if (fflush(fo) != 0 || ftruncate(fileno(fo), (off_t)size) != 0 || fsync(fileno(fo)) != 0){
+        perror("write output");
+        goto fail;
+    }
+    if (fclose(fo) != 0){ fo = NULL; perror("close output"); goto fail; }
+    if (rename(tmp, path) != 0){ perror("rename output"); fo = NULL; goto fail; }
+    free(tmp);
+    return 0;
+fail:
+    if (fo) fclose(fo);
+    remove(tmp);
+    free(tmp);
+    return 1;
+}
+
+// ================= Image lock (same as mkfs_adder) =================
+// Exclusive flock() on the image file, shared by every tool that writes it
+// (see mkfs_adder). Returns the lock descriptor, or -1.
+static int image_lock(const char* path){
+    for (;;){
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0){ perror("open image"); return -1; }
+        if (flock(fd, LOCK_EX) != 0){ perror("lock image"); close(fd); return -1; }
+        struct stat a, b;
+        if (fstat(fd, &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) return fd;
+        close(fd);
+    }
+}
+static void image_unlock(int fd){ if (fd >= 0) close(fd); }
+
+// ================= Relayout =================
+// Copy each file's blocks, in `files` order, to the front of a fresh data
+// region and point the inodes at the copies. Allocated blocks no inode owns
+// are kept, after everything else. Returns 0, or 2 if two inodes claim the
+// same block or one points outside the data region.
+static int relayout(uint8_t* img, const file_t* files, size_t nfiles, uint64_t* moved, uint64_t* hot_end){
+    superblock_t* sb = (superblock_t*)img;
+    inode_t* itab = (inode_t*)(img + (size_t)sb->inode_table_start * BS);
+    uint8_t* data_bm = img + (size_t)sb->data_bitmap_start * BS;
+    uint8_t* data = img + (size_t)sb->data_region_start * BS;
+    size_t nblk = (size_t)sb->data_region_blocks;
+    uint8_t* nd = calloc(nblk ? nblk : 1, BS);
+    uint32_t* remap = malloc((nblk ? nblk : 1) * sizeof(uint32_t));
+    int rc = 2;
+    if (!nd || !remap){ fprintf(stderr,"oom\n"); rc = 1; goto out; }
+    memset(remap, 0xFF, nblk * sizeof(uint32_t));
+
+    size_t cur = 0;
+    *moved = 0;
+    *hot_end = 0;
+    for (size_t k=0;k<nfiles;k++){
+        inode_t* in = &itab[files[k].ino-1];
+        uint64_t n = (in->size_bytes + (BS-1)) / BS;
+        if (n > DIRECT_MAX){ fprintf(stderr,"inode #%u: size out of range\n", files[k].ino); goto out; }
+        for (uint64_t i=0;i<n;i++){
+            uint64_t b = in->direct[i];
+            if (b < sb->data_region_start || b - sb->data_region_start >= nblk ||
+                remap[b - sb->data_region_start] != UINT32_MAX){
+                fprintf(stderr,"inode #%u: bad or shared block %llu\n", files[k].ino, (unsigned long long)b);
+                goto out;
+            }
+            size_t old = (size_t)(b - sb->data_region_start);
+            remap[old] = (uint32_t)cur;
+            memcpy(nd + cur*BS, data + old*BS, BS);
+            *moved += old != cur;
+            in->direct[i] = (uint32_t)(sb->data_region_start + cur);
+            cur++;
+        }
+        inode_crc_finalize(in);
+        if (files[k].count || k == 0) *hot_end = cur;
+    }
+    for (size_t old=0; old<nblk; old++){
+        if (!bitmap_test(data_bm, old) || remap[old] != UINT32_MAX) continue;
+        memcpy(nd + cur*BS, data + old*BS, BS);
+        *moved += old != cur;
+        cur++;
+    }
+    memcpy(data, nd, nblk * BS);
+    memset(data_bm, 0, (nblk + 7) / 8);
+    for (size_t i=0;i<cur;i++) bitmap_set(data_bm, i);
+    rc = 0;
+out:
+    free(nd);
+    free(remap);
+    return rc;
+}
+
+// ================= I/O priority (same as mkfs_adder) =================
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_WHO_PROCESS 1
+
+// Lowest best-effort I/O priority, for --background (see mkfs_adder)
+static void io_background(void){
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7) != 0)
+        perror("ioprio_set (continuing at normal I/O priority)");
+}
+
+// ================= CLI =================
+static void usage(const char* prog){
+    fprintf(stderr, "Usage: %s --image fs.img [--trace <read log> ...] [--background]\n", prog);
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    const char* image = NULL;
+    const char** traces = calloc((size_t)argc, sizeof(*traces));
+    size_t ntraces = 0;
+    int background = 0;
+    if (!traces){ fprintf(stderr,"oom\n"); return 1; }
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--image") && i+1<argc) image = argv[++i];
+        else if (!strcmp(argv[i],"--trace") && i+1<argc) traces[ntraces++] = argv[++i];
+        else if (!strcmp(argv[i],"--background")) background = 1;
+        else { usage(argv[0]); free(traces); return 2; }
+    }
+    if (!image){ usage(argv[0]); free(traces); return 2; }
+    if (background) io_background();
+
+    uint8_t* img = NULL;
+    char* mappath = NULL;
+    file_t* files = NULL;
+    heat_t* h = calloc(1, sizeof(*h));
+    int lock_fd = -1;
+    int rc = 1;
+    if (!h){ fprintf(stderr,"oom\n"); goto out; }
+
+    // Held from the read until the new image and access map are in place
+    if ((lock_fd = image_lock(image)) < 0) goto out;
+    FILE* fi = fopen(image, "rb");
+    if (!fi){ perror("open image"); goto out; }
+    size_t size = 0;
+    if (fseeko(fi, 0, SEEK_END) == 0){
+        off_t end = ftello(fi);
+        size = end > 0 ? (size_t)end : 0;
+    }
+    img = malloc(size ? size : 1);
+    if (!img || fseeko(fi, 0, SEEK_SET) != 0 || fread(img, 1, size, fi) != size){
+        perror("read image");
+        fclose(fi);
+        goto out;
+    }
+    fclose(fi);
+
+    superblock_t* sb = (superblock_t*)img;
+    rc = 2;
+    if (size < BS || sb->block_size != BS || sb->magic != 0x4D565346u || sb->total_blocks > (uint64_t)BS*8 ||
+        (uint64_t)size < sb->total_blocks * BS || sb->data_region_start + sb->data_region_blocks > sb->total_blocks ||
+        sb->inode_table_blocks * (BS / INODE_SIZE) < sb->inode_count){
+        fprintf(stderr,"not a MiniVSFS image\n");
+        goto out;
+    }
+    inode_t* itab = (inode_t*)(img + (size_t)sb->inode_table_start * BS);
+    uint8_t* inode_bm = img + (size_t)sb->inode_bitmap_start * BS;
+    uint32_t dir_block = itab[ROOT_INO-1].direct[0];
+    if (dir_block < sb->data_region_start || dir_block >= sb->total_blocks){
+        fprintf(stderr,"root missing first data block\n");
+        goto out;
+    }
+    const dirent64_t* dent = (const dirent64_t*)(img + (size_t)dir_block * BS);
+    // The directory block moves too, so work from a copy of it
+    dirent64_t dcopy[DIR_ENTRIES];
+    memcpy(dcopy, dent, sizeof(dcopy));
+
+    size_t plen = strlen(image);
+    rc = 1;
+    mappath = malloc(plen + 6);
+    if (!mappath){ fprintf(stderr,"oom\n"); goto out; }
+    memcpy(mappath, image, plen);
+    memcpy(mappath + plen, ".heat", 6);
+    if ((rc = heat_add(h, dcopy, mappath, 1)) != 0) goto out;
+    for (size_t t=0;t<ntraces;t++)
+        if ((rc = heat_add(h, dcopy, traces[t], 0)) != 0) goto out;
+
+    // Every allocated inode; root first so the directory block leads
+    rc = 1;
+    files = calloc((size_t)sb->inode_count, sizeof(*files));
+    if (!files){ fprintf(stderr,"oom\n"); goto out; }
+    size_t nfiles = 0;
+    for (uint64_t i=ROOT_INO; i<sb->inode_count; i++){
+        if (!bitmap_test(inode_bm, (size_t)i)) continue;
+        file_t* f = &files[nfiles++];
+        f->ino = (uint32_t)i + 1;
+        f->first_blk = itab[i].size_bytes ? itab[i].direct[0] : UINT32_MAX;
+        for (size_t s=0;s<DIR_ENTRIES;s++){
+            if (dcopy[s].inode_no != f->ino || !h->count[s]) continue;
+            if (!f->count || h->first[s] < f->first) f->first = h->first[s];
+            f->count += h->count[s];
+        }
+    }
+    qsort(files, nfiles, sizeof(*files), file_cmp);
+    memmove(files + 1, files, nfiles * sizeof(*files));
+    files[0] = (file_t){ ROOT_INO, 0, 0, dir_block };
+    nfiles++;
+
+    uint64_t moved = 0, hot_end = 0;
+    if ((rc = relayout(img, files, nfiles, &moved, &hot_end)) != 0) goto out;
+    rc = 1;
+    size_t hot = 0;
+    while (hot + 1 < nfiles && files[hot + 1].count) hot++;
+
+    if (moved){
+        if (sb->flags & SB_FLAG_MERKLE) merkle_rebuild(img, sb->total_blocks);
+        sb->mtime_epoch = (uint64_t)time(NULL);
+        superblock_crc_finalize(sb);
+        if (image_write(img, size, image) != 0) goto out;
+    }
+    if (heat_write(mappath, h, dcopy, files + 1, nfiles - 1) != 0) goto out;
+
+    fprintf(stdout, "Relaid '%s': %zu hot file(s) in blocks #%llu-#%llu, %llu block(s) moved; %llu read(s) counted -> '%s'\n",
+            image, hot, (unsigned long long)sb->data_region_start,
+            (unsigned long long)(sb->data_region_start + (hot_end ? hot_end - 1 : 0)),
+            (unsigned long long)moved, (unsigned long long)h->reads, mappath);
+    rc = 0;
+
+out:
+    image_unlock(lock_fd);
+    free(files);
+    free(mappath);
+    free(img);
+    free(h);
+    free(traces);
+    return rc;
+}
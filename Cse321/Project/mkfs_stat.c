@@ -0,0 +1,377 @@
+/*
+ Build:
+   gcc -O2 -std=c17 -Wall -Wextra mkfs_stat.c -o mkfs_stat
+
+ Usage:
+   ./mkfs_stat --image fs.img [--json]
+
+ Reports how an image is laid out, to decide when it is worth running
+ mkfs_relayout, mkfs_trim or a rebuild:
+   - utilization of data blocks, inodes and root directory entries, and
+     the slack between stored bytes and the blocks holding them;
+   - free extents (maximal runs of clear bits in the data bitmap) as a
+     histogram by length, plus the largest one;
+   - per file: size, blocks, fragments (runs of consecutive blocks) and
+     seek distances in blocks, from the directory's inode to the file's
+     inode and from the directory block to the file's first data block;
+   - an ASCII heatmap of the data region, HEAT_COLS cells per row, each
+     cell a few blocks shown from '.' (all free) to '@' (all used).
+ Only metadata is read: block 0 up to the data region in one pread, then
+ the directory block. Checksums are not verified. --json prints the same
+ report as one JSON object.
+*/
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;        // 1=file, 2=dir
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+#pragma pack(pop)
+
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+#define DIR_ENTRIES (BS / sizeof(dirent64_t))
+
+static inline void bitmap_set(uint8_t* bm, size_t idx){ bm[idx>>3] |= (uint8_t)(1u << (idx & 7u)); }
+static inline int bitmap_test(const uint8_t* bm, size_t idx){ return (bm[idx>>3] >> (idx & 7u)) & 1u; }
+
+// ================= Report =================
+#define EXT_BUCKETS 16                  // free extents of 2^k .. 2^(k+1)-1 blocks; 2^15 = BS*8
+#define HEAT_COLS   64
+#define HEAT_CELLS  (HEAT_COLS * 8)     // at most 8 rows
+static const char HEAT_CHARS[] = ".:-=+*#@";   // '.' all free, '@' all used
+
+typedef struct {
+    char     name[59];
+    uint32_t ino;
+    uint64_t size, nblocks;
+    uint32_t fragments;
+    uint64_t gap_blocks;                // blocks skipped between fragments
+    uint64_t ino_dist, data_dist;       // seek distance from the directory, in blocks
+} file_report_t;
+
+typedef struct {
+    uint64_t used_blocks, used_inodes, used_entries, stored_bytes, file_blocks;
+    uint64_t free_extents, largest_free;
+    uint64_t ext_count[EXT_BUCKETS], ext_blocks[EXT_BUCKETS];
+    file_report_t files[DIR_ENTRIES];
+    size_t   nfiles;
+    uint64_t fragmented, sum_ino_dist, sum_data_dist, sum_gap;
+    uint64_t per_cell, ncells;
+    char     heat[HEAT_CELLS];
+} report_t;
+
+static uint64_t dist(uint64_t a, uint64_t b){ return a > b ? a - b : b - a; }
+
+static void analyze(const superblock_t* sb, const uint8_t* meta, const dirent64_t* dent, uint32_t dir_block, report_t* r){
+    const uint8_t* inode_bm = meta + (size_t)sb->inode_bitmap_start * BS;
+    const uint8_t* data_bm  = meta + (size_t)sb->data_bitmap_start * BS;
+    const inode_t* itab     = (const inode_t*)(meta + (size_t)sb->inode_table_start * BS);
+    uint64_t nb = sb->data_region_blocks;
+
+    for (uint64_t i=0;i<sb->inode_count;i++) r->used_inodes += bitmap_test(inode_bm, (size_t)i);
+
+    // Free extents and heatmap in one scan of the data bitmap
+    r->per_cell = (nb + HEAT_CELLS - 1) / HEAT_CELLS;
+    if (!r->per_cell) r->per_cell = 1;
+    r->ncells = (nb + r->per_cell - 1) / r->per_cell;
+    uint64_t run = 0, cell_used = 0;
+    for (uint64_t b=0;b<=nb;b++){
+        int used = b < nb && bitmap_test(data_bm, (size_t)b);
+        if (b < nb && !used){ run++; }
+        else if (run){
+            unsigned k = 0;
+            while (k < EXT_BUCKETS-1 && run >> (k+1)) k++;
+            r->ext_count[k]++;
+            r->ext_blocks[k] += run;
+            r->free_extents++;
+            if (run > r->largest_free) r->largest_free = run;
+            run = 0;
+        }
+        if (b == nb) break;
+        r->used_blocks += used;
+        cell_used += used;
+        if ((b+1) % r->per_cell == 0 || b+1 == nb){
+            uint64_t n = b % r->per_cell + 1;
+            size_t lvl = !cell_used ? 0 : cell_used == n ? sizeof(HEAT_CHARS)-2
+                       : 1 + (size_t)(cell_used * (sizeof(HEAT_CHARS)-3) / n);
+            r->heat[b / r->per_cell] = HEAT_CHARS[lvl];
+            cell_used = 0;
+        }
+    }
+
+    // Files in the root directory. Names hard-linked by --dedup share an
+    // inode; its bytes and blocks count once, against the first name.
+    uint8_t seen[BS] = {0};     // one bit per inode (main checks inode_count <= BS*8)
+    uint64_t dir_ino_blk = sb->inode_table_start + (ROOT_INO-1) / (BS / INODE_SIZE);
+    for (size_t s=0;s<DIR_ENTRIES;s++){
+        const dirent64_t* de = &dent[s];
+        if (!de->inode_no) continue;
+        r->used_entries++;
+        if (de->type != 1) continue;
+        if (de->inode_no > sb->inode_count){
+            fprintf(stderr, "entry %zu: inode #%u out of range, skipped\n", s, de->inode_no);
+            continue;
+        }
+        const inode_t* in = &itab[de->inode_no-1];
+        file_report_t* f = &r->files[r->nfiles];
+        memset(f, 0, sizeof(*f));
+        memcpy(f->name, de->name, sizeof(de->name));
+        f->ino = de->inode_no;
+        f->size = in->size_bytes;
+        f->nblocks = (in->size_bytes + (BS-1)) / BS;
+        if (f->nblocks > DIRECT_MAX){
+            fprintf(stderr, "'%s': size %llu beyond %d direct blocks, skipped\n", f->name,
+                    (unsigned long long)in->size_bytes, DIRECT_MAX);
+            continue;
+        }
+        int bad = 0;
+        for (uint64_t i=0;i<f->nblocks;i++)
+            bad |= in->direct[i] < sb->data_region_start || in->direct[i] >= sb->data_region_start + nb;
+        if (bad){ fprintf(stderr, "'%s': block pointer outside the data region, skipped\n", f->name); continue; }
+        for (uint64_t i=0;i<f->nblocks;i++){
+            if (i && in->direct[i] == in->direct[i-1] + 1) continue;
+            f->fragments++;
+            if (i) f->gap_blocks += dist(in->direct[i], (uint64_t)in->direct[i-1] + 1);
+        }
+        f->ino_dist = dist(sb->inode_table_start + (f->ino-1) / (BS / INODE_SIZE), dir_ino_blk);
+        f->data_dist = f->nblocks ? dist(in->direct[0], dir_block) : 0;
+        if (!bitmap_test(seen, f->ino-1)){
+            bitmap_set(seen, f->ino-1);
+            r->stored_bytes += f->size;
+            r->file_blocks += f->nblocks;
+        }
+        r->fragmented += f->fragments > 1;
+        r->sum_ino_dist += f->ino_dist;
+        r->sum_data_dist += f->data_dist;
+        r->sum_gap += f->gap_blocks;
+        r->nfiles++;
+    }
+}
+
+static double pct(uint64_t a, uint64_t b){ return b ? 100.0 * (double)a / (double)b : 0.0; }
+static double avg(uint64_t sum, uint64_t n){ return n ? (double)sum / (double)n : 0.0; }
+
+static void print_text(const char* image, const superblock_t* sb, const report_t* r){
+    uint64_t nb = sb->data_region_blocks;
+    fprintf(stdout, "Image '%s': %llu blocks of %u bytes, data region #%llu-#%llu (%llu blocks)\n", image,
+            (unsigned long long)sb->total_blocks, BS, (unsigned long long)sb->data_region_start,
+            (unsigned long long)(sb->data_region_start + nb - 1), (unsigned long long)nb);
+    fprintf(stdout, "Data blocks: %llu used / %llu (%.1f%%), %llu free in %llu extent(s), largest %llu\n",
+            (unsigned long long)r->used_blocks, (unsigned long long)nb, pct(r->used_blocks, nb),
+            (unsigned long long)(nb - r->used_blocks), (unsigned long long)r->free_extents,
+            (unsigned long long)r->largest_free);
+    fprintf(stdout, "Inodes:      %llu used / %llu (%.1f%%)\n", (unsigned long long)r->used_inodes,
+            (unsigned long long)sb->inode_count, pct(r->used_inodes, sb->inode_count));
+    fprintf(stdout, "Directory:   %llu of %zu entries used\n", (unsigned long long)r->used_entries, DIR_ENTRIES);
+    fprintf(stdout, "Stored:      %llu bytes in %llu file block(s), %.1f%% slack\n",
+            (unsigned long long)r->stored_bytes, (unsigned long long)r->file_blocks,
+            100.0 - pct(r->stored_bytes, r->file_blocks * BS));
+
+    fprintf(stdout, "\nFree extents   count  blocks\n");
+    for (unsigned k=0;k<EXT_BUCKETS;k++){
+        if (!r->ext_count[k]) continue;
+        char range[32];
+        if (k) snprintf(range, sizeof(range), "%llu-%llu", 1ull << k, (2ull << k) - 1);
+        else snprintf(range, sizeof(range), "1");
+        fprintf(stdout, "  %-12s %6llu %7llu\n", range, (unsigned long long)r->ext_count[k],
+                (unsigned long long)r->ext_blocks[k]);
+    }
+
+    fprintf(stdout, "\n%-24s %6s %8s %6s %5s %9s %9s\n", "File", "inode", "bytes", "blocks", "frags", "ino dist", "data dist");
+    for (size_t i=0;i<r->nfiles;i++){
+        const file_report_t* f = &r->files[i];
+        fprintf(stdout, "%-24s %6u %8llu %6llu %5u %9llu %9llu\n", f->name, f->ino, (unsigned long long)f->size,
+                (unsigned long long)f->nblocks, f->fragments, (unsigned long long)f->ino_dist,
+                (unsigned long long)f->data_dist);
+    }
+    fprintf(stdout, "Locality: %zu file(s), %llu fragmented; average seek from the directory %.1f block(s) "
+                    "to the inode, %.1f to the data; %.1f block(s) skipped within files\n",
+            r->nfiles, (unsigned long long)r->fragmented, avg(r->sum_ino_dist, r->nfiles),
+            avg(r->sum_data_dist, r->nfiles), avg(r->sum_gap, r->nfiles));
+
+    fprintf(stdout, "\nHeatmap (%llu block(s) per cell, '.' free .. '@' used):\n", (unsigned long long)r->per_cell);
+    for (uint64_t c=0;c<r->ncells;c+=HEAT_COLS){
+        int n = r->ncells - c < HEAT_COLS ? (int)(r->ncells - c) : HEAT_COLS;
+        fprintf(stdout, "  #%-6llu %.*s\n", (unsigned long long)(sb->data_region_start + c * r->per_cell), n, r->heat + c);
+    }
+}
+
+// Names are raw bytes, not necessarily UTF-8: bytes >= 0x80 are written as
+// \u00XX (read as Latin-1) so the output is always valid JSON
+static void json_string(const char* s){
+    fputc('"', stdout);
+    for (; *s; s++){
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') fprintf(stdout, "\\%c", ch);
+        else if (ch < 0x20 || ch >= 0x80) fprintf(stdout, "\\u%04x", ch);
+        else fputc(ch, stdout);
+    }
+    fputc('"', stdout);
+}
+
+static void print_json(const char* image, const superblock_t* sb, const report_t* r){
+    uint64_t nb = sb->data_region_blocks;
+    fprintf(stdout, "{\"image\":");
+    json_string(image);
+    fprintf(stdout, ",\"block_size\":%u,\"total_blocks\":%llu,\"data_region\":{\"start\":%llu,\"blocks\":%llu},",
+            BS, (unsigned long long)sb->total_blocks, (unsigned long long)sb->data_region_start, (unsigned long long)nb);
+    fprintf(stdout, "\"data_blocks\":{\"used\":%llu,\"free\":%llu},\"inodes\":{\"used\":%llu,\"total\":%llu},",
+            (unsigned long long)r->used_blocks, (unsigned long long)(nb - r->used_blocks),
+            (unsigned long long)r->used_inodes, (unsigned long long)sb->inode_count);
+    fprintf(stdout, "\"dir_entries\":{\"used\":%llu,\"total\":%zu},\"stored_bytes\":%llu,\"file_blocks\":%llu,",
+            (unsigned long long)r->used_entries, DIR_ENTRIES, (unsigned long long)r->stored_bytes,
+            (unsigned long long)r->file_blocks);
+    fprintf(stdout, "\"free_extents\":{\"count\":%llu,\"largest\":%llu,\"histogram\":[",
+            (unsigned long long)r->free_extents, (unsigned long long)r->largest_free);
+    int first = 1;
+    for (unsigned k=0;k<EXT_BUCKETS;k++){
+        if (!r->ext_count[k]) continue;
+        fprintf(stdout, "%s{\"min\":%llu,\"max\":%llu,\"count\":%llu,\"blocks\":%llu}", first ? "" : ",",
+                1ull << k, (2ull << k) - 1, (unsigned long long)r->ext_count[k], (unsigned long long)r->ext_blocks[k]);
+        first = 0;
+    }
+    fprintf(stdout, "]},\"files\":[");
+    for (size_t i=0;i<r->nfiles;i++){
+        const file_report_t* f = &r->files[i];
+        fprintf(stdout, "%s{\"name\":", i ? "," : "");
+        json_string(f->name);
+        fprintf(stdout, ",\"inode\":%u,\"size\":%llu,\"blocks\":%llu,\"fragments\":%u,\"gap_blocks\":%llu,"
+                        "\"inode_distance\":%llu,\"data_distance\":%llu}",
+                f->ino, (unsigned long long)f->size, (unsigned long long)f->nblocks, f->fragments,
+                (unsigned long long)f->gap_blocks, (unsigned long long)f->ino_dist, (unsigned long long)f->data_dist);
+    }
+    fprintf(stdout, "],\"locality\":{\"fragmented_files\":%llu,\"avg_inode_distance\":%.3f,"
+                    "\"avg_data_distance\":%.3f,\"avg_gap_blocks\":%.3f},",
+            (unsigned long long)r->fragmented, avg(r->sum_ino_dist, r->nfiles),
+            avg(r->sum_data_dist, r->nfiles), avg(r->sum_gap, r->nfiles));
+    fprintf(stdout, "\"heatmap\":{\"blocks_per_cell\":%llu,\"rows\":[", (unsigned long long)r->per_cell);
+    for (uint64_t c=0;c<r->ncells;c+=HEAT_COLS){
+        int n = r->ncells - c < HEAT_COLS ? (int)(r->ncells - c) : HEAT_COLS;
+        fprintf(stdout, "%s\"%.*s\"", c ? "," : "", n, r->heat + c);
+    }
+    fprintf(stdout, "]}}\n");
+}
+
+// ================= CLI =================
+static void usage(const char* prog){
+    fprintf(stderr, "Usage: %s --image fs.img [--json]\n", prog);
+}
+
+int main(int argc, char** argv){
+    const char* image = NULL;
+    int json = 0;
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--image") && i+1<argc) image = argv[++i];
+        else if (!strcmp(argv[i],"--json")) json = 1;
+        else { usage(argv[0]); return 2; }
+    }
+    if (!image){ usage(argv[0]); return 2; }
+
+    uint8_t* meta = NULL;
+    report_t* r = NULL;
+    int rc = 1;
+    int fd = open(image, O_RDONLY);
+    if (fd < 0){ perror("open image"); return 1; }
+
+    superblock_t sb;
+    if (pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)){ perror("read superblock"); goto out; }
+    rc = 2;
+    if (sb.block_size != BS || sb.magic != 0x4D565346u || sb.total_blocks > (uint64_t)BS*8 ||
+        sb.data_region_start + sb.data_region_blocks > sb.total_blocks || sb.data_region_blocks > (uint64_t)BS*8 ||
+        sb.inode_count < ROOT_INO || sb.inode_table_blocks < 1 ||
+        sb.inode_table_blocks * (BS / INODE_SIZE) < sb.inode_count ||
+        sb.inode_table_start + sb.inode_table_blocks > sb.data_region_start ||
+        sb.inode_bitmap_start >= sb.data_region_start || sb.data_bitmap_start >= sb.data_region_start ||
+        (sb.inode_count + 7) / 8 > BS){
+        fprintf(stderr,"not a MiniVSFS image\n");
+        goto out;
+    }
+
+    // Everything before the data region in one read
+    rc = 1;
+    size_t mlen = (size_t)sb.data_region_start * BS;
+    meta = malloc(mlen);
+    r = calloc(1, sizeof(*r));
+    if (!meta || !r){ fprintf(stderr,"oom\n"); goto out; }
+    if (pread(fd, meta, mlen, 0) != (ssize_t)mlen){ perror("read metadata"); goto out; }
+
+    const inode_t* root = (const inode_t*)(meta + (size_t)sb.inode_table_start * BS) + (ROOT_INO-1);
+    uint32_t dir_block = root->direct[0];
+    if (dir_block < sb.data_region_start || dir_block >= sb.total_blocks){
+        fprintf(stderr,"root missing first data block\n");
+        rc = 2;
+        goto out;
+    }
+    dirent64_t dent[DIR_ENTRIES];
+    if (pread(fd, dent, sizeof(dent), (off_t)dir_block * BS) != (ssize_t)sizeof(dent)){ perror("read directory"); goto out; }
+
+    analyze(&sb, meta, dent, dir_block, r);
+    if (json) print_json(image, &sb, r);
+    else print_text(image, &sb, r);
+    rc = fflush(stdout) != 0;
+    if (rc) perror("write");
+
+out:
+    close(fd);
+    free(meta);
+    free(r);
+    return rc;
+}
@@ -0,0 +1,896 @@
+/*
+ Build:
+   gcc -O2 -std=c17 -Wall -Wextra mkfs_sync.c -o mkfs_sync
+
+ Usage:
+   ./mkfs_sync --dir <host dir> --image fs.img [--discard] [--watch [--debounce-ms <n>]] [--background]
+               [--metrics <file>]
+
+ Makes the image's root directory mirror the regular files of a host
+ directory, touching only what changed:
+   - files whose size and mtime match the image are skipped;
+   - changed files are compared block by block and only differing blocks are
+     rewritten in place (blocks are added or freed if the size changed);
+   - new files are added, files missing from the host are deleted.
+ Everything lands in one commit: the modified blocks are written in place,
+ data first and the superblock last, under the exclusive flock() every
+ image writer takes (see mkfs_adder). Freed blocks are zeroed, or with
+ --discard punched out of the host file (see mkfs_trim).
+
+ --watch keeps running after the first pass and mirrors changes as they
+ happen: inotify reports files closed after writing, moved in, moved out or
+ deleted; events are collected until the directory has been quiet for
+ --debounce-ms (default 10, and never more than 10x that since the first
+ event), and each batch is applied as one commit. The image lock is taken
+ per batch, not for the whole session; if another tool changed the image
+ since our last commit, it is read again before the batch is applied.
+ SIGINT/SIGTERM stop it after the current batch.
+
+ --background runs the sync at the lowest best-effort I/O priority, so
+ readers of the image are served first (see mkfs_adder).
+
+ --metrics rewrites <file> after every batch with running totals, a commit
+ latency histogram and free space, in the Prometheus text format (same
+ layout as mkfs_adder --metrics).
+*/
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+
+#define SB_FLAG_MERKLE      0x1u    // superblock_t.flags: hash tree present
+#define MERKLE_GROUP_BLOCKS 64u     // blocks hashed into one leaf
+#define MERKLE_LEAVES       16u     // 4096 KiB max image / 64 blocks per leaf
+#define MERKLE_OFFSET       2048u   // byte offset of the node array in block 0
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[DIRECT_MAX];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;        // 1=file, 2=dir
+    char     name[58];
+    uint8_t  checksum;
+} dirent64_t;
+#pragma pack(pop)
+
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+// ================= CRC32 (same definitions as mkfs_adder) =================
+static uint32_t CRC32_TAB[256];
+static void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for (int j=0;j<8;j++){
+            c = (c&1)? (0xEDB88320u ^ (c>>1)) : (c>>1);
+        }
+        CRC32_TAB[i]=c;
+    }
+}
+static uint32_t crc32_update(uint32_t crc, const void*buf, size_t len){
+    const uint8_t* p=(const uint8_t*)buf;
+    for (size_t i=0;i<len;i++){
+        crc = CRC32_TAB[(crc ^ p[i]) & 0xFFu] ^ (crc>>8);
+    }
+    return crc;
+}
+static uint32_t crc32_finalize(const void*buf, size_t len){
+    uint32_t c = 0xFFFFFFFFu;
+    c = crc32_update(c, buf, len);
+    return c ^ 0xFFFFFFFFu;
+}
+static void superblock_crc_finalize(superblock_t* sb){
+    sb->checksum = 0;
+    sb->checksum = crc32_finalize(sb, sizeof(*sb));
+}
+static void inode_crc_finalize(inode_t* in){
+    in->inode_crc = 0;
+    in->inode_crc = (uint64_t)crc32_finalize(in, sizeof(*in));
+}
+static void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    de->checksum = x;
+}
+
+// ================= Bitmap helpers =================
+static inline void bitmap_set(uint8_t* bm, size_t idx){ bm[idx>>3] |= (uint8_t)(1u << (idx & 7u)); }
+static inline void bitmap_clear(uint8_t* bm, size_t idx){ bm[idx>>3] &= (uint8_t)~(1u << (idx & 7u)); }
+static inline int  bitmap_test(const uint8_t* bm, size_t idx){ return (bm[idx>>3] >> (idx & 7u)) & 1u; }
+static long long bitmap_ffz(const uint8_t* bm, size_t bits){
+    for (size_t i=0;i<bits;i++){ if (!bitmap_test(bm,i)) return (long long)i; }
+    return -1;
+}
+
+// ================= Merkle tree (layout: see mkfs_builder) =================
+static uint32_t merkle_leaf(const uint8_t* img, uint64_t total_blocks, uint32_t leaf){
+    uint32_t blk_crc[MERKLE_GROUP_BLOCKS];
+    uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+    if (first >= total_blocks) return 0;
+    uint64_t n = total_blocks - first;
+    if (n > MERKLE_GROUP_BLOCKS) n = MERKLE_GROUP_BLOCKS;
+    for (uint64_t i=0;i<n;i++)
+        blk_crc[i] = (first+i == 0) ? 0 : crc32_finalize(img + (size_t)(first+i)*BS, BS);
+    return crc32_finalize(blk_crc, (size_t)n * sizeof(uint32_t));
+}
+
+static void merkle_update(uint8_t* img, uint64_t total_blocks, const uint8_t* dirty){
+    uint32_t* tree = (uint32_t*)(img + MERKLE_OFFSET);
+    for (uint32_t leaf=0; leaf<MERKLE_LEAVES; leaf++){
+        uint64_t first = (uint64_t)leaf * MERKLE_GROUP_BLOCKS;
+        int touched = 0;
+        for (uint64_t b=first; b<first+MERKLE_GROUP_BLOCKS && b<total_blocks; b++)
+            if (bitmap_test(dirty, (size_t)b)){ touched = 1; break; }
+        if (!touched) continue;
+        size_t n = MERKLE_LEAVES-1+leaf;
+        tree[n] = merkle_leaf(img, total_blocks, leaf);
+        while (n){
+            n = (n-1)/2;
+            tree[n] = crc32_finalize(&tree[2*n+1], 2*sizeof(uint32_t));
+        }
+    }
+}
+
+// ================= Image =================
+typedef struct {
+    int           fd;
+    uint8_t*      img;        // whole image, read into memory
+    size_t        size;
+    superblock_t* sb;
+    uint8_t*      inode_bm;
+    uint8_t*      data_bm;
+    inode_t*      itab;
+    inode_t*      root;
+    uint32_t      dir_block;  // root directory block
+    dirent64_t*   dent;
+    uint8_t       dirty[BS];  // image blocks to write at commit
+    uint8_t       freed[BS];  // image blocks freed during this run
+} image_t;
+
+#define DIR_ENTRIES (BS / sizeof(dirent64_t))
+
+// Returns 0 on success, 1 on I/O error, 2 if the file is not a usable image
+static int image_open(image_t* im, const char* path){
+    im->fd = open(path, O_RDWR);
+    if (im->fd < 0){ perror("open image"); return 1; }
+    struct stat st;
+    if (fstat(im->fd, &st) != 0){ perror("stat image"); return 1; }
+    if (st.st_size < (off_t)BS){ fprintf(stderr,"not a MiniVSFS image\n"); return 2; }
+    im->size = (size_t)st.st_size;
+    im->img = malloc(im->size);
+    if (!im->img){ fprintf(stderr,"oom\n"); return 1; }
+    if (pread(im->fd, im->img, im->size, 0) != (ssize_t)im->size){ perror("read image"); return 1; }
+
+    superblock_t* sb = im->sb = (superblock_t*)im->img;
+    if (sb->block_size != BS || sb->magic != 0x4D565346u || sb->total_blocks > (uint64_t)BS*8 ||
+        (uint64_t)im->size < sb->total_blocks * BS){
+        fprintf(stderr,"not a MiniVSFS image\n");
+        return 2;
+    }
+    im->inode_bm = im->img + (size_t)sb->inode_bitmap_start * BS;
+    im->data_bm  = im->img + (size_t)sb->data_bitmap_start  * BS;
+    im->itab     = (inode_t*)(im->img + (size_t)sb->inode_table_start * BS);
+    im->root     = &im->itab[ROOT_INO-1];
+    im->dir_block = im->root->direct[0];
+    if (im->dir_block < sb->data_region_start || im->dir_block >= sb->total_blocks){
+        fprintf(stderr,"root missing first data block\n");
+        return 2;
+    }
+    im->dent = (dirent64_t*)(im->img + (size_t)im->dir_block * BS);
+    return 0;
+}
+
+static void mark_inode(image_t* im, uint32_t ino){
+    bitmap_set(im->dirty, (size_t)(im->sb->inode_table_start + (uint64_t)(ino-1) * INODE_SIZE / BS));
+}
+
+// Placement follows mkfs_adder, so a synced image is laid out like one
+// built by mkfs_adder --delalloc: new inodes go to the inode-table block
+// already holding most of the root directory's children (see
+// dir_goal_block() there), and a file's blocks go in the smallest free run
+// that holds them all, falling back to first-free block by block. sync
+// places one file at a time, so it scans the bitmap rather than keeping
+// mkfs_adder's extent index.
+static uint64_t dir_goal_block(const image_t* im){
+    const uint32_t per = BS / INODE_SIZE;
+    uint64_t best = (ROOT_INO - 1) / per;
+    size_t best_n = 0;
+    for (size_t i=0;i<DIR_ENTRIES;i++){
+        uint32_t ino = im->dent[i].inode_no;
+        if (!ino || ino == ROOT_INO || ino > im->sb->inode_count) continue;
+        size_t n = 0;
+        for (size_t j=0;j<DIR_ENTRIES;j++)
+            n += im->dent[j].inode_no && im->dent[j].inode_no != ROOT_INO &&
+                 (im->dent[j].inode_no - 1) / per == (ino - 1) / per;
+        if (n > best_n){ best_n = n; best = (ino - 1) / per; }
+    }
+    return best;
+}
+
+// Lowest free inode in the goal block, else in the nearest block to it
+// (goal, goal+1, goal-1, goal+2, ...). Returns the inode number, or -1.
+static long long inode_alloc(image_t* im){
+    const uint64_t per = BS / INODE_SIZE, n = im->sb->inode_count;
+    const uint64_t nblk = (n + per - 1) / per;
+    uint64_t goal = dir_goal_block(im);
+    for (uint64_t d=0; d<2*nblk; d++){
+        uint64_t step = (d + 1) / 2;
+        if (!(d & 1) && step > goal) continue;
+        uint64_t b = (d & 1) ? goal + step : goal - step;
+        if (b >= nblk) continue;
+        for (uint64_t i=b*per; i<(b+1)*per && i<n; i++){
+            if (!bitmap_test(im->inode_bm, (size_t)i)){
+                bitmap_set(im->inode_bm, (size_t)i);
+                memset(&im->itab[i], 0, sizeof(inode_t));
+                return (long long)i + 1;
+            }
+        }
+    }
+    return -1;
+}
+
+static void inode_release(image_t* im, uint32_t ino){
+    memset(&im->itab[ino-1], 0, sizeof(inode_t));
+    bitmap_clear(im->inode_bm, ino-1);
+    mark_inode(im, ino);
+}
+
+static long long block_alloc(image_t* im){
+    long long i = bitmap_ffz(im->data_bm, (size_t)im->sb->data_region_blocks);
+    if (i < 0) return -1;
+    bitmap_set(im->data_bm, (size_t)i);
+    return (long long)im->sb->data_region_start + i;
+}
+
+// Data-region index of the smallest free run of at least `len` blocks, or -1
+static long long run_best_fit(const image_t* im, uint64_t len){
+    uint64_t nb = im->sb->data_region_blocks, best_len = UINT64_MAX;
+    long long best = -1;
+    for (uint64_t i=0;i<nb;){
+        if (bitmap_test(im->data_bm, (size_t)i)){ i++; continue; }
+        uint64_t j = i;
+        while (j < nb && !bitmap_test(im->data_bm, (size_t)j)) j++;
+        if (j - i >= len && j - i < best_len){ best = (long long)i; best_len = j - i; }
+        i = j;
+    }
+    return best;
+}
+
+// Blocks for direct[from..to): right after direct[from-1] when those are
+// free, else the best-fitting run, else first-free one at a time
+static int blocks_alloc(image_t* im, uint32_t* direct, uint64_t from, uint64_t to){
+    const superblock_t* sb = im->sb;
+    uint64_t need = to - from;
+    long long run = -1;
+    if (from){
+        uint64_t next = (uint64_t)direct[from-1] + 1 - sb->data_region_start;
+        uint64_t k = 0;
+        while (k < need && next + k < sb->data_region_blocks && !bitmap_test(im->data_bm, (size_t)(next + k))) k++;
+        if (k == need) run = (long long)next;
+    }
+    if (run < 0) run = run_best_fit(im, need);
+    for (uint64_t i=0;i<need;i++){
+        if (run >= 0){
+            bitmap_set(im->data_bm, (size_t)run + i);
+            direct[from+i] = (uint32_t)(sb->data_region_start + (uint64_t)run + i);
+        } else {
+            long long b = block_alloc(im);
+            if (b < 0) return -1;
+            direct[from+i] = (uint32_t)b;
+        }
+    }
+    return 0;
+}
+
+// Freed blocks are zeroed in memory so free space stays zero-filled; on disk
+// they are either rewritten as zeros or punched at commit.
+static void block_release(image_t* im, uint32_t b){
+    bitmap_clear(im->data_bm, b - im->sb->data_region_start);
+    memset(im->img + (size_t)b*BS, 0, BS);
+    bitmap_set(im->freed, b);
+}
+
+// Make the inode's contents equal buf[0..size), rewriting only blocks that
+// differ. Returns the number of blocks written, or -1 if the image is full.
+static long long inode_set_contents(image_t* im, inode_t* in, const uint8_t* buf, uint64_t size){
+    uint64_t old_n = (in->size_bytes + (BS-1)) / BS;
+    uint64_t new_n = (size + (BS-1)) / BS;
+    long long written = 0;
+    for (uint64_t i=new_n;i<old_n;i++){ block_release(im, in->direct[i]); in->direct[i] = 0; }
+    if (new_n > old_n && blocks_alloc(im, in->direct, old_n, new_n) != 0) return -1;
+    for (uint64_t i=0;i<new_n;i++){
+        uint8_t blk[BS] = {0};
+        size_t n = size - i*BS > BS ? BS : (size_t)(size - i*BS);
+        memcpy(blk, buf + (size_t)(i*BS), n);
+        if (i < old_n && memcmp(im->img + (size_t)in->direct[i]*BS, blk, BS) == 0){
+            continue;
+        }
+        memcpy(im->img + (size_t)in->direct[i]*BS, blk, BS);
+        bitmap_set(im->dirty, in->direct[i]);
+        written++;
+    }
+    in->size_bytes = size;
+    return written;
+}
+
+// Whether the inode already holds exactly buf[0..size)
+static int inode_contents_equal(const image_t* im, const inode_t* in, const uint8_t* buf, uint64_t size){
+    if (in->size_bytes != size) return 0;
+    for (uint64_t i=0; i*BS < size; i++){
+        size_t n = size - i*BS > BS ? BS : (size_t)(size - i*BS);
+        if (memcmp(im->img + (size_t)in->direct[i]*BS, buf + (size_t)(i*BS), n) != 0) return 0;
+    }
+    return 1;
+}
+
+static int dir_find(const image_t* im, const char* name){
+    for (size_t i=0;i<DIR_ENTRIES;i++)
+        if (im->dent[i].inode_no && strncmp(im->dent[i].name, name, sizeof(im->dent[i].name)) == 0) return (int)i;
+    return -1;
+}
+
+static void dir_set(image_t* im, size_t slot, uint32_t ino, const char* name){
+    dirent64_t de;
+    memset(&de, 0, sizeof(de));
+    de.inode_no = ino;
+    de.type = 1; // file
+    strncpy(de.name, name, sizeof(de.name)-1);
+    dirent_checksum_finalize(&de);
+    im->dent[slot] = de;
+    bitmap_set(im->dirty, im->dir_block);
+}
+
+// Drop one name of an inode, freeing the inode and its blocks with the last one
+static void unlink_slot(image_t* im, size_t slot){
+    uint32_t ino = im->dent[slot].inode_no;
+    inode_t* in = &im->itab[ino-1];
+    memset(&im->dent[slot], 0, sizeof(dirent64_t));
+    bitmap_set(im->dirty, im->dir_block);
+    im->root->links -= 1;
+    if (in->links > 1){
+        in->links -= 1;
+        inode_crc_finalize(in);
+        mark_inode(im, ino);
+        return;
+    }
+    for (uint64_t i=0;i<(in->size_bytes + (BS-1)) / BS;i++) block_release(im, in->direct[i]);
+    inode_release(im, ino);
+}
+
+static int pwrite_all(int fd, const uint8_t* p, size_t n, off_t off){
+    while (n){
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0){ if (errno == EINTR) continue; return -1; }
+        p += w; n -= (size_t)w; off += w;
+    }
+    return 0;
+}
+
+// Write every dirty block back in place, one pwrite per run of adjacent
+// blocks, then the superblock once the rest is on disk.
+static int image_commit(image_t* im, int discard){
+    superblock_t* sb = im->sb;
+    for (uint64_t b=0;b<sb->total_blocks;b++){
+        if (bitmap_test(im->freed, (size_t)b) && !bitmap_test(im->data_bm, (size_t)(b - sb->data_region_start)) && !discard)
+            bitmap_set(im->dirty, (size_t)b);
+    }
+    bitmap_set(im->dirty, (size_t)sb->inode_bitmap_start);
+    bitmap_set(im->dirty, (size_t)sb->data_bitmap_start);
+    inode_crc_finalize(im->root);
+    mark_inode(im, ROOT_INO);
+
+    // Punched blocks read back as zero, which is what memory holds for them
+    uint8_t hashed[BS];
+    memcpy(hashed, im->dirty, BS);
+    for (size_t i=0;i<BS;i++) hashed[i] |= im->freed[i];
+    if (sb->flags & SB_FLAG_MERKLE) merkle_update(im->img, sb->total_blocks, hashed);
+    sb->mtime_epoch = (uint64_t)time(NULL);
+    superblock_crc_finalize(sb);
+
+    for (uint64_t b=1;b<sb->total_blocks;){
+        if (!bitmap_test(im->dirty, (size_t)b)){ b++; continue; }
+        uint64_t e = b;
+        while (e < sb->total_blocks && bitmap_test(im->dirty, (size_t)e)) e++;
+        if (pwrite_all(im->fd, im->img + (size_t)b*BS, (size_t)(e-b)*BS, (off_t)(b*BS)) != 0){ perror("write image"); return 1; }
+        b = e;
+    }
+    if (fdatasync(im->fd) != 0){ perror("sync image"); return 1; }
+    if (pwrite_all(im->fd, im->img, BS, 0) != 0 || fdatasync(im->fd) != 0){ perror("write superblock"); return 1; }
+
+    if (discard){
+        for (uint64_t b=0;b<sb->total_blocks;){
+            if (!bitmap_test(im->freed, (size_t)b) || bitmap_test(im->data_bm, (size_t)(b - sb->data_region_start))){ b++; continue; }
+            uint64_t e = b;
+            while (e < sb->total_blocks && bitmap_test(im->freed, (size_t)e) &&
+                   !bitmap_test(im->data_bm, (size_t)(e - sb->data_region_start))) e++;
+            if (fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(b*BS), (off_t)((e-b)*BS)) != 0){
+                perror("fallocate");
+                return 1;
+            }
+            b = e;
+        }
+    }
+    memset(im->dirty, 0, sizeof(im->dirty));
+    memset(im->freed, 0, sizeof(im->freed));
+    return 0;
+}
+
+// ================= Image lock (same as mkfs_adder) =================
+// Exclusive flock() on the image file, shared by every tool that writes it
+// (see mkfs_adder). Returns the lock descriptor, or -1.
+static int image_lock(const char* path){
+    for (;;){
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0){ perror("open image"); return -1; }
+        if (flock(fd, LOCK_EX) != 0){ perror("lock image"); close(fd); return -1; }
+        struct stat a, b;
+        if (fstat(fd, &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) return fd;
+        close(fd);
+    }
+}
+static void image_unlock(int fd){ if (fd >= 0) close(fd); }
+
+// ================= Image identity (same as mkfs_cat) =================
+// Identity of the image file, to notice writers (in place or by rename)
+typedef struct { dev_t dev; ino_t ino; off_t size; struct timespec mtime; } file_id_t;
+
+static int file_id(const char* path, file_id_t* id){
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    *id = (file_id_t){ st.st_dev, st.st_ino, st.st_size, st.st_mtim };
+    return 0;
+}
+static int file_id_eq(const file_id_t* a, const file_id_t* b){
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+// Read the image again (and reopen it, in case it was replaced by rename)
+// after another tool changed it. Caller holds the image lock.
+static int image_reload(image_t* im, const char* path){
+    if (im->fd >= 0) close(im->fd);
+    free(im->img);
+    memset(im, 0, sizeof(*im));
+    im->fd = -1;
+    return image_open(im, path);
+}
+
+// ================= Metrics (format as in mkfs_adder) =================
+#define HIST_BUCKETS 24          // bucket i: more than 2^(i-1), at most 2^i us
+
+typedef struct { uint64_t count, sum_us, bucket[HIST_BUCKETS]; } hist_t;
+
+static struct {
+    const char* path;            // --metrics, or NULL
+    uint64_t    batches, added, updated, removed, unchanged, blocks_written;
+    hist_t      commit_us;
+} metrics;
+
+static uint64_t now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void hist_record(hist_t* h, uint64_t us){
+    unsigned b = 0;
+    uint64_t v = us ? us - 1 : 0;
+    while (b < HIST_BUCKETS-1 && v >> b) b++;
+    h->bucket[b]++;
+    h->sum_us += us;
+    h->count++;
+}
+
+static void prom_label(FILE* f, const char* s){
+    for (; *s; s++){
+        if (*s == '\\' || *s == '"') fputc('\\', f);
+        if (*s == '\n'){ fputs("\\n", f); continue; }
+        fputc(*s, f);
+    }
+}
+
+static void prom_metric(FILE* f, const char* name, const char* type, const char* help, const char* image, uint64_t v){
+    fprintf(f, "# HELP minivsfs_%s %s\n# TYPE minivsfs_%s %s\nminivsfs_%s{image=\"", name, help, name, type, name);
+    prom_label(f, image);
+    fprintf(f, "\"} %" PRIu64 "\n", v);
+}
+
+static void prom_hist(FILE* f, const char* name, const char* help, const char* image, const hist_t* h){
+    fprintf(f, "# HELP minivsfs_%s %s\n# TYPE minivsfs_%s histogram\n", name, help, name);
+    uint64_t cum = 0;
+    for (unsigned b=0;b<HIST_BUCKETS-1;b++){
+        cum += h->bucket[b];
+        fprintf(f, "minivsfs_%s_bucket{image=\"", name);
+        prom_label(f, image);
+        fprintf(f, "\",le=\"%.6f\"} %" PRIu64 "\n", (double)(1ull << b) / 1e6, cum);
+    }
+    fprintf(f, "minivsfs_%s_bucket{image=\"", name);
+    prom_label(f, image);
+    fprintf(f, "\",le=\"+Inf\"} %" PRIu64 "\n", h->count);
+    fprintf(f, "minivsfs_%s_sum{image=\"", name);
+    prom_label(f, image);
+    fprintf(f, "\"} %g\nminivsfs_%s_count{image=\"", (double)h->sum_us / 1e6, name);
+    prom_label(f, image);
+    fprintf(f, "\"} %" PRIu64 "\n", h->count);
+}
+
+static uint64_t count_zero(const uint8_t* bm, uint64_t bits){
+    uint64_t n = 0;
+    for (uint64_t i=0;i<bits;i++) n += !bitmap_test(bm, (size_t)i);
+    return n;
+}
+
+// Written to <path>.tmp and renamed into place
+static int metrics_write(const image_t* im, const char* image){
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics.path);
+    FILE* f = fopen(tmp, "w");
+    if (!f){ perror("open metrics"); return 1; }
+    const superblock_t* sb = im->sb;
+    prom_metric(f, "sync_batches_total", "counter", "Batches applied (first pass included).", image, metrics.batches);
+    prom_metric(f, "sync_files_added_total", "counter", "Files added to the image.", image, metrics.added);
+    prom_metric(f, "sync_files_updated_total", "counter", "Files whose contents were updated.", image, metrics.updated);
+    prom_metric(f, "sync_files_removed_total", "counter", "Files removed from the image.", image, metrics.removed);
+    prom_metric(f, "sync_files_unchanged_total", "counter", "Files skipped as unchanged.", image, metrics.unchanged);
+    prom_metric(f, "sync_blocks_written_total", "counter", "Data blocks rewritten.", image, metrics.blocks_written);
+    prom_hist(f, "sync_commit_seconds", "Time to commit one batch.", image, &metrics.commit_us);
+    prom_metric(f, "data_blocks", "gauge", "Data region size in blocks.", image, sb->data_region_blocks);
+    prom_metric(f, "data_blocks_free", "gauge", "Free data blocks.", image, count_zero(im->data_bm, sb->data_region_blocks));
+    prom_metric(f, "inodes", "gauge", "Inode table size.", image, sb->inode_count);
+    prom_metric(f, "inodes_free", "gauge", "Free inodes.", image, count_zero(im->inode_bm, sb->inode_count));
+    int bad = ferror(f);
+    if (fclose(f) != 0 || bad || rename(tmp, metrics.path) != 0){
+        perror("write metrics");
+        remove(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+// ================= Sync =================
+typedef struct {
+    size_t    added, updated, removed, unchanged;
+    long long written;
+} sync_stats_t;
+
+static int read_host_file(const char* path, uint8_t* buf, uint64_t size){
+    FILE* f = fopen(path, "rb");
+    if (!f){ perror(path); return 1; }
+    size_t got = fread(buf, 1, (size_t)size, f);
+    int more = fgetc(f) != EOF;
+    fclose(f);
+    if (got != size || more){ fprintf(stderr, "%s: changed while reading, skipped\n", path); return 1; }
+    return 0;
+}
+
+// Bring one name in line with the host directory: add or update it, or
+// unlink it if the host no longer has it. `force` skips the size+mtime
+// shortcut (the caller knows the file was written). Files that cannot be
+// read are skipped with a warning; returns 1 only if the image is full.
+static int sync_name(image_t* im, const char* dir, const char* name, int force, sync_stats_t* st){
+    static uint8_t buf[DIRECT_MAX*BS];
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int slot = dir_find(im, name);
+    if (slot >= 0 && im->dent[slot].type != 1){
+        fprintf(stderr, "skipping '%s': not a file in the image\n", name);
+        return 0;
+    }
+
+    struct stat hs;
+    if (stat(path, &hs) != 0 || !S_ISREG(hs.st_mode)){
+        if (slot >= 0){ unlink_slot(im, (size_t)slot); st->removed++; }
+        return 0;
+    }
+    if (strlen(name) >= sizeof(im->dent[0].name)){
+        fprintf(stderr, "skipping '%s': name too long\n", name);
+        return 0;
+    }
+    uint64_t size = (uint64_t)hs.st_size;
+    if (size > (uint64_t)DIRECT_MAX*BS){
+        fprintf(stderr, "skipping '%s': too large for MiniVSFS\n", name);
+        return 0;
+    }
+
+    inode_t* in = slot >= 0 ? &im->itab[im->dent[slot].inode_no-1] : NULL;
+    if (in && !force && in->size_bytes == size && in->mtime == (uint64_t)hs.st_mtime){ st->unchanged++; return 0; }
+    if (read_host_file(path, buf, size) != 0) return 0;
+
+    time_t now = time(NULL);
+    if (in && in->links > 1 && inode_contents_equal(im, in, buf, size)){
+        // Shared with other names (mkfs_adder --dedup) and still identical:
+        // keep the link. The names' host mtimes can differ, so keep the
+        // newest instead of flipping between them on every pass.
+        if ((uint64_t)hs.st_mtime <= in->mtime){ st->unchanged++; return 0; }
+        in->mtime = (uint64_t)hs.st_mtime;
+        in->ctime = (uint64_t)now;
+        inode_crc_finalize(in);
+        mark_inode(im, im->dent[slot].inode_no);
+        st->updated++;
+        return 0;
+    }
+    int split = in && in->links > 1;
+    if (split){
+        // Shared with other names (mkfs_adder --dedup): give this one its own copy
+        in->links -= 1;
+        inode_crc_finalize(in);
+        mark_inode(im, im->dent[slot].inode_no);
+        im->root->links -= 1;
+        memset(&im->dent[slot], 0, sizeof(dirent64_t));
+        in = NULL;
+    }
+    if (in){
+        long long w = inode_set_contents(im, in, buf, size);
+        if (w < 0){ fprintf(stderr,"no free data blocks\n"); return 1; }
+        st->written += w;
+        st->updated++;
+    } else {
+        if (slot < 0 || im->dent[slot].inode_no == 0){
+            slot = 0;
+            while ((size_t)slot < DIR_ENTRIES && im->dent[slot].inode_no) slot++;
+            if ((size_t)slot == DIR_ENTRIES){ fprintf(stderr, "Error: root directory is full.\n"); return 1; }
+        }
+        long long ino = inode_alloc(im);
+        if (ino < 0){ fprintf(stderr,"no free inode available\n"); return 1; }
+        in = &im->itab[ino-1];
+        in->mode = 0100000;       // file
+        in->links = 1;
+        in->proj_id = 14;         // group ID 14
+        in->atime = (uint64_t)now;
+        long long w = inode_set_contents(im, in, buf, size);
+        if (w < 0){ fprintf(stderr,"no free data blocks\n"); return 1; }
+        st->written += w;
+        dir_set(im, (size_t)slot, (uint32_t)ino, name);
+        im->root->links += 1;
+        if (split) st->updated++; else st->added++;
+    }
+    in->mtime = (uint64_t)hs.st_mtime;
+    in->ctime = (uint64_t)now;
+    inode_crc_finalize(in);
+    mark_inode(im, im->dent[slot].inode_no);
+    return 0;
+}
+
+// Commit whatever the stats say changed, and report it
+static int finish_batch(image_t* im, int discard, const char* dir, const char* image, const sync_stats_t* st){
+    size_t used = 0;
+    for (size_t i=0;i<DIR_ENTRIES;i++) used += im->dent[i].inode_no != 0;
+    im->root->size_bytes = (uint64_t)(used * sizeof(dirent64_t));
+    uint64_t t0 = now_us();
+    if (st->added + st->updated + st->removed){
+        if (image_commit(im, discard) != 0) return 1;
+        hist_record(&metrics.commit_us, now_us() - t0);
+    }
+    fprintf(stdout, "Synced '%s' -> '%s': %zu added, %zu updated, %zu removed, %zu unchanged, %lld block(s) written\n",
+            dir, image, st->added, st->updated, st->removed, st->unchanged, st->written);
+    fflush(stdout);
+    metrics.batches++;
+    metrics.added += st->added;
+    metrics.updated += st->updated;
+    metrics.removed += st->removed;
+    metrics.unchanged += st->unchanged;
+    metrics.blocks_written += (uint64_t)st->written;
+    return metrics.path ? metrics_write(im, image) : 0;
+}
+
+// Full pass: every host file, plus every image file the host no longer has
+static int sync_all(image_t* im, const char* dir, sync_stats_t* st){
+    DIR* d = opendir(dir);
+    if (!d){ perror(dir); return 1; }
+    uint8_t seen[DIR_ENTRIES/8] = {0};
+    struct dirent* e;
+    while ((e = readdir(d))){
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        if (sync_name(im, dir, e->d_name, 0, st) != 0){ closedir(d); return 1; }
+        int slot = dir_find(im, e->d_name);
+        if (slot >= 0) bitmap_set(seen, (size_t)slot);
+    }
+    closedir(d);
+    for (size_t i=2;i<DIR_ENTRIES;i++){
+        if (im->dent[i].inode_no && im->dent[i].type == 1 && !bitmap_test(seen, i)){
+            unlink_slot(im, i);
+            st->removed++;
+        }
+    }
+    return 0;
+}
+
+// ================= Watch =================
+#define WATCH_MAX_NAMES 1024      // distinct names per batch before falling back to a full pass
+
+static volatile sig_atomic_t stop_requested;
+static void on_stop(int sig){ (void)sig; stop_requested = 1; }
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// `id` is the image identity after our last commit
+static int watch_loop(image_t* im, const char* dir, const char* image, int discard, int debounce_ms, file_id_t* id){
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0){ perror("inotify_init1"); return 1; }
+    if (inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0){
+        perror("inotify_add_watch");
+        close(ifd);
+        return 1;
+    }
+    signal(SIGINT, on_stop);
+    signal(SIGTERM, on_stop);
+
+    static char names[WATCH_MAX_NAMES][NAME_MAX+1];
+    size_t nnames = 0;
+    int full = 0;
+    long long first_event = 0;
+    _Alignas(struct inotify_event) char evbuf[64*1024];
+    int rc = 0;
+    while (!rc){
+        int pending = nnames || full;
+        int timeout = -1;
+        if (pending){
+            long long left = first_event + 10LL*debounce_ms - now_ms();
+            timeout = left < debounce_ms ? (left > 0 ? (int)left : 0) : debounce_ms;
+        }
+        struct pollfd pfd = { ifd, POLLIN, 0 };
+        int n = stop_requested ? 0 : poll(&pfd, 1, timeout);
+        if (n < 0 && errno != EINTR){ perror("poll"); rc = 1; break; }
+        if (n > 0){
+            ssize_t len = read(ifd, evbuf, sizeof(evbuf));
+            if (len < 0 && errno != EINTR && errno != EAGAIN){ perror("read inotify"); rc = 1; break; }
+            for (ssize_t off=0; off<len; ){
+                const struct inotify_event* ev = (const struct inotify_event*)(evbuf + off);
+                off += (ssize_t)(sizeof(*ev) + ev->len);
+                if (!pending){ first_event = now_ms(); pending = 1; }
+                if (ev->mask & IN_Q_OVERFLOW){ full = 1; continue; }
+                if (!ev->len || full) continue;
+                size_t k = 0;
+                while (k < nnames && strcmp(names[k], ev->name) != 0) k++;
+                if (k < nnames) continue;
+                if (nnames == WATCH_MAX_NAMES){ full = 1; continue; }
+                strcpy(names[nnames++], ev->name);
+            }
+            if (!stop_requested && now_ms() - first_event < 10LL*debounce_ms) continue;
+        }
+        if (nnames || full){
+            // Locked per batch only, so other writers can get in between
+            int lock_fd = image_lock(image);
+            if (lock_fd < 0){ rc = 1; break; }
+            file_id_t now;
+            if (file_id(image, &now) != 0){ perror("stat image"); rc = 1; }
+            else if (!file_id_eq(&now, id)) rc = image_reload(im, image);
+            sync_stats_t st = {0};
+            if (!rc && full) rc = sync_all(im, dir, &st);
+            for (size_t k=0; !full && !rc && k<nnames; k++) rc = sync_name(im, dir, names[k], 1, &st);
+            if (!rc) rc = finish_batch(im, discard, dir, image, &st);
+            if (!rc && file_id(image, id) != 0){ perror("stat image"); rc = 1; }
+            image_unlock(lock_fd);
+            nnames = 0;
+            full = 0;
+        }
+        if (stop_requested) break;
+    }
+    close(ifd);
+    return rc;
+}
+
+// ================= I/O priority (same as mkfs_adder) =================
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_WHO_PROCESS 1
+
+// Lowest best-effort I/O priority, for --background (see mkfs_adder)
+static void io_background(void){
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7) != 0)
+        perror("ioprio_set (continuing at normal I/O priority)");
+}
+
+// ================= CLI =================
+static void usage(const char* prog){
+    fprintf(stderr, "Usage: %s --dir <host dir> --image fs.img [--discard] [--watch [--debounce-ms <n>]] [--background]\n"
+                    "          [--metrics <file>]\n", prog);
+}
+
+int main(int argc, char** argv){
+    crc32_init();
+    const char* dir = NULL;
+    const char* image = NULL;
+    int discard = 0;
+    int watch = 0;
+    int background = 0;
+    long debounce_ms = 10;
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--dir") && i+1<argc) dir = argv[++i];
+        else if (!strcmp(argv[i],"--image") && i+1<argc) image = argv[++i];
+        else if (!strcmp(argv[i],"--discard")) discard = 1;
+        else if (!strcmp(argv[i],"--watch")) watch = 1;
+        else if (!strcmp(argv[i],"--background")) background = 1;
+        else if (!strcmp(argv[i],"--debounce-ms") && i+1<argc) debounce_ms = strtol(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i],"--metrics") && i+1<argc) metrics.path = argv[++i];
+        else { usage(argv[0]); return 2; }
+    }
+    if (!dir || !image || debounce_ms < 1 || debounce_ms > 60000){ usage(argv[0]); return 2; }
+    if (background) io_background();
+
+    image_t* im = calloc(1, sizeof(*im));
+    int rc = 1;
+    if (!im){ fprintf(stderr,"oom\n"); return 1; }
+    im->fd = -1;
+    int lock_fd = image_lock(image);
+    if (lock_fd < 0) goto out;
+    if ((rc = image_open(im, image)) != 0){ image_unlock(lock_fd); goto out; }
+
+    sync_stats_t st = {0};
+    file_id_t id;
+    rc = sync_all(im, dir, &st);
+    if (!rc) rc = finish_batch(im, discard, dir, image, &st);
+    if (!rc && file_id(image, &id) != 0){ perror("stat image"); rc = 1; }
+    image_unlock(lock_fd);
+    if (!rc && watch) rc = watch_loop(im, dir, image, discard, (int)debounce_ms, &id);
+
+out:
+    if (im->fd >= 0) close(im->fd);
+    free(im->img);
+    free(im);
+    return rc;
+}
@@ -0,0 +1,136 @@
+/*
+ Build:
+   gcc -O2 -std=c17 -Wall -Wextra mkfs_trim.c -o mkfs_trim
+
+ Usage:
+   ./mkfs_trim --image fs.img
+
+ Punches a hole in the host file for every run of free blocks in the data
+ region (clear bits in the data bitmap), one fallocate() per run, so the image
+ only occupies host disk space for blocks that are in use. The image size is
+ unchanged. Free blocks are always zero-filled (mkfs_builder writes them that
+ way), and a hole reads back as zeros, so contents and the merkle tree stay
+ the same. The exclusive flock() every image writer takes (see mkfs_adder)
+ is held throughout, so no block is allocated between reading the bitmap
+ and punching.
+*/
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define BS 4096u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+#pragma pack(pop)
+
+static inline int bitmap_test(const uint8_t* bm, size_t idx){ return (bm[idx>>3] >> (idx & 7u)) & 1u; }
+
+// ================= Image lock (same as mkfs_adder) =================
+// Exclusive flock() on the image file, shared by every tool that writes it
+// (see mkfs_adder). Returns the lock descriptor, or -1.
+static int image_lock(const char* path){
+    for (;;){
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0){ perror("open image"); return -1; }
+        if (flock(fd, LOCK_EX) != 0){ perror("lock image"); close(fd); return -1; }
+        struct stat a, b;
+        if (fstat(fd, &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) return fd;
+        close(fd);
+    }
+}
+static void image_unlock(int fd){ if (fd >= 0) close(fd); }
+
+static void usage(const char* prog){
+    fprintf(stderr, "Usage: %s --image fs.img\n", prog);
+}
+
+int main(int argc, char** argv){
+    const char* image = NULL;
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--image") && i+1<argc) image = argv[++i];
+        else { usage(argv[0]); return 2; }
+    }
+    if (!image){ usage(argv[0]); return 2; }
+
+    // Held from reading the bitmap to the last punch, so no writer can
+    // allocate a block in between
+    int lock_fd = image_lock(image);
+    if (lock_fd < 0) return 1;
+    int fd = open(image, O_RDWR);
+    int rc = 1;
+    if (fd < 0){ perror("open image"); goto out; }
+
+    superblock_t sb;
+    uint8_t data_bm[BS];
+    if (pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)){ perror("read superblock"); goto out; }
+    if (sb.block_size != BS || sb.magic != 0x4D565346u || sb.data_region_blocks > (uint64_t)BS*8){
+        fprintf(stderr,"not a MiniVSFS image\n");
+        rc = 2;
+        goto out;
+    }
+    if (pread(fd, data_bm, BS, (off_t)(sb.data_bitmap_start * BS)) != (ssize_t)BS){
+        perror("read data bitmap");
+        goto out;
+    }
+
+    struct stat st_before;
+    if (fstat(fd, &st_before) != 0){ perror("stat image"); goto out; }
+
+    // One punch per maximal run of free blocks
+    uint64_t punched = 0, ranges = 0;
+    for (uint64_t i=0;i<sb.data_region_blocks;){
+        if (bitmap_test(data_bm, (size_t)i)){ i++; continue; }
+        uint64_t j = i;
+        while (j < sb.data_region_blocks && !bitmap_test(data_bm, (size_t)j)) j++;
+        off_t off = (off_t)((sb.data_region_start + i) * BS);
+        off_t len = (off_t)((j - i) * BS);
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) != 0){
+            perror("fallocate");
+            goto out;
+        }
+        punched += j - i;
+        ranges++;
+        i = j;
+    }
+
+    struct stat st_after;
+    if (fstat(fd, &st_after) != 0){ perror("stat image"); goto out; }
+
+    fprintf(stdout, "Trimmed '%s': %llu free block(s) in %llu range(s); on disk %llu KiB -> %llu KiB\n",
+            image, (unsigned long long)punched, (unsigned long long)ranges,
+            (unsigned long long)st_before.st_blocks / 2, (unsigned long long)st_after.st_blocks / 2);
+    rc = 0;
+
+out:
+    if (fd >= 0) close(fd);
+    image_unlock(lock_fd);
+    return rc;
+}